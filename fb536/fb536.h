@@ -2,12 +2,182 @@
 #define _FB536_H_
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 struct fb_viewport {
     unsigned short x, y;
     unsigned short width, height;
 };
 
+/* 32-bit variants for frames the 16-bit legacy interface cannot describe */
+struct fb_viewport2 {
+    __u32 x, y;
+    __u32 width, height;
+};
+
+struct fb_size2 {
+    __u32 width, height;
+    __u32 flags;
+    __u32 bpp;      /* FB536_BPP_*; 0 keeps the current format */
+};
+
+/*
+ * fb_size2.bpp. Viewport offsets and sizes are in bytes, so a w x h
+ * viewport is w * h * bpp / 8 bytes long. Pixels are native-endian.
+ */
+#define FB536_BPP_8      8      /* one 8-bit channel */
+#define FB536_BPP_16     16     /* RGB565; ADD/SUB writes must be pixel aligned */
+#define FB536_BPP_32     32     /* ARGB8888 */
+
+/* fb_size2.flags */
+#define FB536_SIZE_KEEP  0x1    /* keep overlapping content, as FB536_IOCTRESIZE */
+
+/*
+ * Reduction over the file's viewport. Samples are the viewport's bytes,
+ * i.e. the channels for the 8bpp and 32bpp formats.
+ */
+struct fb_stats {
+    __u64 count;        /* samples examined */
+    __u64 sum;
+    __u64 nonzero;
+    __u32 min, max;
+    __u64 hist[256];
+};
+
+/*
+ * The frame is divided into FB536_TILE_SIZE square tiles, each carrying
+ * the device generation of the last change to it. Generations only grow,
+ * also across resizes.
+ */
+#define FB536_TILE_SHIFT 6
+#define FB536_TILE_SIZE  (1 << FB536_TILE_SHIFT)
+
+struct fb_tiles {
+    __u64 gens;             /* user pointer to a __u64 array, row-major */
+    __u32 capacity;         /* entries available at gens */
+    __u32 tx, ty;           /* out: first tile column and row of the viewport */
+    __u32 ncols, nrows;     /* out: tiles covered; -ENOSPC if above capacity */
+    __u32 reserved;
+    __u64 gen;              /* out: current device generation */
+};
+
+/*
+ * Delta read: the viewport bytes in tiles changed since this file's last
+ * complete delta read, as a sequence of fb_delta_run records each followed
+ * by its bytes and padding to a multiple of 8. The first call after open
+ * or FB536_IOCSETVIEWPORT returns the whole viewport. When the buffer
+ * fills up, FB536_DELTA_MORE is set and the next call continues the pass.
+ */
+struct fb_delta {
+    __u64 buf;          /* user pointer */
+    __u32 len;          /* size of buf */
+    __u32 used;         /* out: bytes of records written */
+    __u32 flags;        /* in: FB536_DELTA_FULL, out: FB536_DELTA_MORE */
+    __u32 reserved;
+    __u64 gen;          /* out: generation the file is synced to */
+};
+
+struct fb_delta_run {
+    __u64 offset;       /* viewport byte offset, as for read() */
+    __u32 length;
+    __u32 reserved;
+};
+
+#define FB536_DELTA_FULL 0x1    /* forget what was seen, start a full pass */
+#define FB536_DELTA_MORE 0x2    /* pass incomplete, call again */
+
+/*
+ * Run-length encoded write at the file offset, applied with the file's
+ * op like write(). buf holds control bytes, each followed by pixels of
+ * the device's format: c < 128 is followed by c + 1 literal pixels,
+ * c >= 128 by one pixel repeated c - 126 times. Returns bytes applied.
+ */
+struct fb_rle_write {
+    __u64 buf;          /* user pointer */
+    __u32 len;          /* encoded length */
+    __u32 reserved;
+};
+
+/*
+ * Read the viewport as it was at an earlier generation (see fb_tiles.gen),
+ * from the per-minor history enabled with FB536_IOCTSETHISTORY. Fails
+ * with -ENOENT once that generation has left the history. Returns bytes
+ * read; offset is a viewport byte offset and the file offset is unused.
+ */
+struct fb_gen_read {
+    __u64 gen;
+    __u64 buf;          /* user pointer */
+    __u64 offset;
+    __u32 len;
+    __u32 reserved;
+};
+
+/*
+ * Exclusive waiting: FB536_IOCWAIT of files in the same named group wakes
+ * one waiter per change that intersects any member's viewport. Members are
+ * not rate limited by FB536_IOCTSETWAKERATE. An empty name leaves.
+ */
+#define FB536_GROUP_NAME_LEN 16
+
+struct fb_wait_group {
+    char name[FB536_GROUP_NAME_LEN];
+};
+
+/*
+ * Records read from debugfs fb536/<minor>/trace while fb536/<minor>/record
+ * is 1 (metadata) or 2 (also a crc32 of written data). fb536replay plays
+ * them back.
+ */
+#define FB536_REC_OPEN      1   /* arg: open flags */
+#define FB536_REC_RELEASE   2
+#define FB536_REC_IOCTL     3   /* cmd, arg; argbuf for _IOW structs */
+#define FB536_REC_LLSEEK    4   /* cmd: whence, arg: offset */
+#define FB536_REC_READ      5   /* arg: file position, count */
+#define FB536_REC_WRITE     6   /* arg: file position, count, hash */
+
+struct fb536_rec {
+    __u64 ts_ns;        /* CLOCK_MONOTONIC at entry to the call */
+    __u64 file;         /* per-minor open sequence number */
+    __u32 type;
+    __u32 cmd;
+    __u64 arg;
+    __u64 count;
+    __s64 ret;
+    __u32 hash;
+    __u32 reserved;
+    __u8 argbuf[16];
+};
+
+/*
+ * dma-buf export of a region of the frame, the whole frame if its width or
+ * height is 0. The buffer holds the pages the region's rows lie in: its
+ * top-left pixel is at offset and rows are stride bytes apart. Like
+ * FB536_IOCSHMEMFD it keeps the frame current at export time. Starting CPU
+ * access (DMA_BUF_IOCTL_SYNC) makes earlier writes of the device visible.
+ * Ending it after writing to a FB536_DMABUF_WRITE buffer counts as a write
+ * of every frame row its pages overlap, which may be more than the region,
+ * and wakes their waiters. Such a write empties the history, as
+ * FB536_IOCREADGEN cannot go back past it.
+ */
+struct fb_dmabuf {
+    struct fb_viewport2 region;
+    __u32 flags;        /* FB536_DMABUF_* */
+    __s32 fd;           /* out: close-on-exec */
+    __u64 offset;       /* out */
+    __u64 stride;       /* out */
+    __u64 size;         /* out: bytes of the dma-buf */
+};
+
+#define FB536_DMABUF_WRITE 0x1  /* writable buffer; needs a file open for writing */
+
+#define FB536_MAX_HISTORY 1024
+#define FB536_MAX_WC_US   1000000
+#define FB536_MAX_WAKE_US 1000000
+
+#define FB536_MIN_DIM    256
+#define FB536_MAX_DIM    10000      /* FB536_IOCTSETSIZE / FB536_IOCTRESIZE */
+#define FB536_MAX_DIM2   (1 << 20)  /* FB536_IOCSETSIZE2 */
+
 #define FB536_SET   0
 #define FB536_ADD   1
 #define FB536_SUB   2
@@ -25,7 +195,73 @@ struct fb_viewport {
 #define FB536_IOCTSETOP      _IO(FB536_IOC_MAGIC, 5)
 #define FB536_IOCQGETOP      _IO(FB536_IOC_MAGIC, 6)
 #define FB536_IOCWAIT        _IO(FB536_IOC_MAGIC, 7)
+/* Like FB536_IOCTSETSIZE, but keeps the overlapping top-left region */
+#define FB536_IOCTRESIZE     _IO(FB536_IOC_MAGIC, 8)
+
+#define FB536_IOCSETVIEWPORT2 _IOW(FB536_IOC_MAGIC, 9, struct fb_viewport2)
+#define FB536_IOCGETVIEWPORT2 _IOR(FB536_IOC_MAGIC, 10, struct fb_viewport2)
+#define FB536_IOCSETSIZE2     _IOW(FB536_IOC_MAGIC, 11, struct fb_size2)
+#define FB536_IOCGETSIZE2     _IOR(FB536_IOC_MAGIC, 12, struct fb_size2)
+
+#define FB536_IOCGETSTATS     _IOR(FB536_IOC_MAGIC, 13, struct fb_stats)
+
+#define FB536_IOCGETTILES     _IOWR(FB536_IOC_MAGIC, 14, struct fb_tiles)
+
+#define FB536_IOCDELTAREAD    _IOWR(FB536_IOC_MAGIC, 15, struct fb_delta)
+
+#define FB536_IOCWRITERLE     _IOW(FB536_IOC_MAGIC, 16, struct fb_rle_write)
+
+#define FB536_IOCTSETHISTORY  _IO(FB536_IOC_MAGIC, 17)     /* versions kept, 0 = off */
+#define FB536_IOCREADGEN      _IOWR(FB536_IOC_MAGIC, 18, struct fb_gen_read)
+
+/* Combine small writes, flushing them within arg microseconds; 0 = off */
+#define FB536_IOCTSETWC       _IO(FB536_IOC_MAGIC, 19)
+
+/* Wake FB536_IOCWAIT at most once per arg microseconds; 0 = off */
+#define FB536_IOCTSETWAKERATE _IO(FB536_IOC_MAGIC, 20)
+/* Bounding box of viewport changes since the last call; empty if none */
+#define FB536_IOCGETDAMAGE    _IOR(FB536_IOC_MAGIC, 21, struct fb_viewport2)
+
+#define FB536_IOCJOINGROUP    _IOW(FB536_IOC_MAGIC, 22, struct fb_wait_group)
+
+/* Signal the eventfd arg on changes to the viewport; -1 unbinds */
+#define FB536_IOCBINDEVENTFD  _IO(FB536_IOC_MAGIC, 23)
+
+/*
+ * 1: XOR, OR and AND writes of this file go to per-CPU deltas, merged into
+ * the frame before it is next read and shortly after the write; 0 = off
+ */
+#define FB536_IOCTSETDELTA    _IO(FB536_IOC_MAGIC, 24)
+
+/*
+ * 1: writes of this file are queued and return at once, and a worker of
+ * the minor applies them in order; 0 = off. FB536_IOCFLUSH waits for the
+ * queue to drain and returns the first error of a queued write since the
+ * last flush. poll() reports POLLOUT while the queue is empty.
+ */
+#define FB536_IOCTSETASYNC    _IO(FB536_IOC_MAGIC, 25)
+#define FB536_IOCFLUSH        _IO(FB536_IOC_MAGIC, 26)
+
+/*
+ * With the module loaded shmem=1, returns a new read-only, close-on-exec
+ * fd on the shmem file holding the minor's frame, row-major with a stride
+ * of width * bpp bytes. It keeps the frame current at export time, so
+ * export again after a resize. Fails with ENODEV without shmem=1.
+ */
+#define FB536_IOCSHMEMFD      _IO(FB536_IOC_MAGIC, 27)
+
+#define FB536_IOCEXPORTDMABUF _IOWR(FB536_IOC_MAGIC, 28, struct fb_dmabuf)
+
+#define FB536_IOC_MAXNR 28
+
+/* Commands whose argument structs hold user pointers, which a trace cannot replay */
+#define FB536_IOC_USER_PTR(cmd) \
+    ((cmd) == FB536_IOCGETTILES || (cmd) == FB536_IOCDELTAREAD || \
+     (cmd) == FB536_IOCWRITERLE || (cmd) == FB536_IOCREADGEN)
 
-#define FB536_IOC_MAXNR 7
+/* Commands that take or return file descriptors, which only mean something in the caller */
+#define FB536_IOC_FD_ARG(cmd) \
+    ((cmd) == FB536_IOCBINDEVENTFD || (cmd) == FB536_IOCSHMEMFD || \
+     (cmd) == FB536_IOCEXPORTDMABUF)
 
 #endif
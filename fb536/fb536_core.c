@@ -0,0 +1,311 @@
+/* -*- C -*-
+ * fb536_core.c -- fb536 code shared with the user-space benchmark and fuzzer
+ */
+
+#ifdef __KERNEL__
+#include <linux/string.h>
+#include <linux/errno.h>
+#include <linux/list.h>
+#include <linux/uaccess.h>
+#endif
+#include "fb536_core.h"
+
+/* Bytes of a read or write of count at viewport offset pos that fall inside the viewport */
+size_t fb536_span(const struct fb_viewport2 *vp, u64 w, u64 h, u32 bpp, u64 pos, size_t count) {
+    u64 vp_size;
+
+    if (!fb536_vp_usable(vp, w, h))
+        return 0;
+    vp_size = (u64)vp->width * vp->height * bpp;
+    if (pos >= vp_size)
+        return 0;
+    return min_t(u64, count, vp_size - pos);
+}
+
+/* Viewport rows, as a frame region, that bytes [pos, pos + count) touch */
+void fb536_span_region(const struct fb_viewport2 *vp, u32 bpp, u64 pos, size_t count,
+                       struct fb_viewport2 *region) {
+    u64 row_bytes = (u64)vp->width * bpp;
+    u64 start_row = div64_u64(pos, row_bytes);
+    u64 end_row = div64_u64(pos + count - 1, row_bytes);
+
+    region->x = vp->x;
+    region->width = vp->width;
+    region->y = vp->y + start_row;
+    region->height = end_row - start_row + 1;
+}
+
+/* Grow the damage box by the part of region inside viewport vp */
+void fb536_add_damage(const struct fb_viewport2 *vp, struct fb_viewport2 *d,
+                      const struct fb_viewport2 *region) {
+    u64 x0 = vp->x, y0 = vp->y, x1 = (u64)vp->x + vp->width, y1 = (u64)vp->y + vp->height;
+
+    if (region) {
+        x0 = max_t(u64, x0, region->x);
+        y0 = max_t(u64, y0, region->y);
+        x1 = min_t(u64, x1, (u64)region->x + region->width);
+        y1 = min_t(u64, y1, (u64)region->y + region->height);
+    }
+    if (x0 >= x1 || y0 >= y1)
+        return;
+    if (d->width && d->height) {
+        x0 = min_t(u64, x0, d->x);
+        y0 = min_t(u64, y0, d->y);
+        x1 = max_t(u64, x1, (u64)d->x + d->width);
+        y1 = max_t(u64, y1, (u64)d->y + d->height);
+    }
+    d->x = x0;
+    d->y = y0;
+    d->width = x1 - x0;
+    d->height = y1 - y0;
+}
+
+/*
+ * Apply count bytes of src at viewport offset pos, which fb536_span has
+ * clipped to the viewport, to frame one frame row at a time. mark, if
+ * set, is told of each row before it changes.
+ */
+void fb536_apply_span(unsigned char *frame, const struct fb_viewport2 *vp, u64 w, u32 bpp,
+                      fb536_op_fn apply, const unsigned char *src, size_t count, u64 pos,
+                      fb536_mark_fn mark, void *ctx) {
+    u64 row_bytes = (u64)vp->width * bpp, vp_row, vp_col;
+    size_t done;
+
+    for (done = 0; done < count; ) {
+        u64 off = fb536_frame_off(vp, w, bpp, pos + done, &vp_row, &vp_col);
+        size_t chunk = min_t(u64, count - done, row_bytes - vp_col);
+
+        if (mark)
+            mark(ctx, vp->x + div_u64(vp_col, bpp), vp->x + div_u64(vp_col + chunk - 1, bpp),
+                 vp->y + vp_row, off, chunk);
+        apply(frame + off, src + done, chunk);
+        done += chunk;
+    }
+}
+
+/* Copy count clipped bytes at viewport offset pos out to buf; 0 or -EFAULT */
+int fb536_read_span(char __user *buf, const unsigned char *frame, const struct fb_viewport2 *vp,
+                    u64 w, u32 bpp, size_t count, u64 pos) {
+    u64 row_bytes = (u64)vp->width * bpp, vp_row, vp_col;
+    size_t done;
+
+    for (done = 0; done < count; ) {
+        u64 off = fb536_frame_off(vp, w, bpp, pos + done, &vp_row, &vp_col);
+        size_t chunk = min_t(u64, count - done, row_bytes - vp_col);
+
+        if (copy_to_user(buf + done, frame + off, chunk))
+            return -EFAULT;
+        done += chunk;
+    }
+    return 0;
+}
+
+/*
+ * Wake the files on files, linked through the list_head node_off bytes
+ * into each and with their viewport at vp_off, that a change to region
+ * concerns. Returns the files scanned.
+ */
+unsigned long fb536_notify_scan(struct list_head *files, size_t node_off, size_t vp_off,
+                                const struct fb_viewport2 *region, fb536_wake_fn wake) {
+    struct list_head *n;
+    unsigned long scanned = 0;
+
+    for (n = files->next; n != files; n = n->next) {
+        char *file = (char *)n - node_off;
+
+        scanned++;
+        if (fb536_affected((const struct fb_viewport2 *)(file + vp_off), region))
+            wake(file, region);
+    }
+    return scanned;
+}
+
+/*
+ * Length in bytes of the RLE stream in, or -EINVAL if it is truncated.
+ * Each control byte c is followed by c + 1 literal pixels when below 128,
+ * or by one pixel repeated c - 126 times otherwise.
+ */
+long fb536_rle_length(const unsigned char *in, size_t len, u32 bpp) {
+    size_t i = 0;
+    long out = 0;
+
+    while (i < len) {
+        unsigned int c = in[i++];
+        unsigned int npix = c < 128 ? c + 1 : c - 126;
+        size_t need = c < 128 ? npix * bpp : bpp;
+
+        if (len - i < need)
+            return -EINVAL;
+        i += need;
+        out += npix * bpp;
+    }
+    return out;
+}
+
+/* Bytes of the whole runs at the start of in */
+size_t fb536_rle_whole(const unsigned char *in, size_t len, u32 bpp) {
+    size_t i = 0;
+
+    while (i < len) {
+        size_t run = 1 + (in[i] < 128 ? (in[i] + 1) * bpp : bpp);
+
+        if (len - i < run)
+            break;
+        i += run;
+    }
+    return i;
+}
+
+/*
+ * Decode a validated RLE stream and hand it to emit in runs of output,
+ * repeated pixels gathered in scratch (FB536_RLE_CHUNK bytes), stopping
+ * after count output bytes.
+ */
+void fb536_rle_apply(const unsigned char *in, size_t count, u32 bpp, u64 pos,
+                     unsigned char *scratch, fb536_emit_fn emit, void *ctx) {
+    size_t fill = 0, i = 0, n;
+
+    while (count) {
+        unsigned int c = in[i++];
+        unsigned int npix = c < 128 ? c + 1 : c - 126;
+        size_t bytes = npix * bpp;
+
+        if (c < 128) {
+            /* Literal pixels apply straight from the input */
+            if (fill) {
+                emit(ctx, scratch, fill, pos);
+                pos += fill;
+                fill = 0;
+            }
+            n = min(bytes, count);
+            emit(ctx, in + i, n, pos);
+            pos += n;
+            count -= n;
+            i += bytes;
+            continue;
+        }
+        for (; npix && count; npix--) {
+            n = min_t(size_t, bpp, count);
+            memcpy(scratch + fill, in + i, n);
+            fill += n;
+            count -= n;
+            if (fill + bpp > FB536_RLE_CHUNK) {
+                emit(ctx, scratch, fill, pos);
+                pos += fill;
+                fill = 0;
+            }
+        }
+        i += bpp;
+    }
+    if (fill)
+        emit(ctx, scratch, fill, pos);
+}
+
+/*
+ * Per-format write kernels. SET and the bitwise ops act on bytes and are
+ * shared; ADD and SUB saturate per channel: one 8-bit channel for 8bpp,
+ * 5/6/5-bit channels for 16bpp RGB565 and four 8-bit channels for 32bpp
+ * ARGB8888, the last done a word at a time.
+ */
+static void fb536_set8(unsigned char *dst, const unsigned char *src, size_t n) {
+    memcpy(dst, src, n);
+}
+
+static void fb536_add8(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        unsigned int v = dst[i] + src[i];
+        dst[i] = v > 255 ? 255 : v;
+    }
+}
+
+static void fb536_sub8(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        dst[i] = dst[i] > src[i] ? dst[i] - src[i] : 0;
+}
+
+static void fb536_and8(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        dst[i] &= src[i];
+}
+
+static void fb536_or8(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        dst[i] |= src[i];
+}
+
+static void fb536_xor8(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++)
+        dst[i] ^= src[i];
+}
+
+#define RGB565_R(p) ((p) >> 11)
+#define RGB565_G(p) (((p) >> 5) & 0x3F)
+#define RGB565_B(p) ((p) & 0x1F)
+#define RGB565(r, g, b) ((u16)(((r) << 11) | ((g) << 5) | (b)))
+
+/* n is a multiple of 2: unaligned 16bpp ADD/SUB writes are rejected */
+static void fb536_add565(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    u16 a, b;
+    for (i = 0; i < n; i += 2) {
+        memcpy(&a, dst + i, 2);
+        memcpy(&b, src + i, 2);
+        a = RGB565(min(RGB565_R(a) + RGB565_R(b), 0x1F),
+                   min(RGB565_G(a) + RGB565_G(b), 0x3F),
+                   min(RGB565_B(a) + RGB565_B(b), 0x1F));
+        memcpy(dst + i, &a, 2);
+    }
+}
+
+static void fb536_sub565(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    u16 a, b;
+    for (i = 0; i < n; i += 2) {
+        memcpy(&a, dst + i, 2);
+        memcpy(&b, src + i, 2);
+        a = RGB565(RGB565_R(a) > RGB565_R(b) ? RGB565_R(a) - RGB565_R(b) : 0,
+                   RGB565_G(a) > RGB565_G(b) ? RGB565_G(a) - RGB565_G(b) : 0,
+                   RGB565_B(a) > RGB565_B(b) ? RGB565_B(a) - RGB565_B(b) : 0);
+        memcpy(dst + i, &a, 2);
+    }
+}
+
+/* Channels are bytes, so any byte alignment gives the same result */
+static void fb536_add8888(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    u32 a, b, s, c;
+    for (i = 0; i + 4 <= n; i += 4) {
+        memcpy(&a, dst + i, 4);
+        memcpy(&b, src + i, 4);
+        s = ((a & 0x7F7F7F7F) + (b & 0x7F7F7F7F)) ^ ((a ^ b) & 0x80808080);
+        c = ((a & b) | ((a | b) & ~s)) & 0x80808080;
+        s |= (c >> 7) * 0xFF;
+        memcpy(dst + i, &s, 4);
+    }
+    fb536_add8(dst + i, src + i, n - i);
+}
+
+static void fb536_sub8888(unsigned char *dst, const unsigned char *src, size_t n) {
+    size_t i;
+    u32 a, b, d, c;
+    for (i = 0; i + 4 <= n; i += 4) {
+        memcpy(&a, dst + i, 4);
+        memcpy(&b, src + i, 4);
+        d = ((a | 0x80808080) - (b & 0x7F7F7F7F)) ^ ((a ^ ~b) & 0x80808080);
+        c = ((~a & b) | (~(a ^ b) & d)) & 0x80808080;
+        d &= ~((c >> 7) * 0xFF);
+        memcpy(dst + i, &d, 4);
+    }
+    fb536_sub8(dst + i, src + i, n - i);
+}
+
+const fb536_op_fn fb536_ops[3][6] = {
+    { fb536_set8, fb536_add8,    fb536_sub8,    fb536_and8, fb536_or8, fb536_xor8 },
+    { fb536_set8, fb536_add565,  fb536_sub565,  fb536_and8, fb536_or8, fb536_xor8 },
+    { fb536_set8, fb536_add8888, fb536_sub8888, fb536_and8, fb536_or8, fb536_xor8 },
+};
@@ -0,0 +1,111 @@
+/* -*- C -*-
+ * fb536_core.h -- viewport arithmetic, write kernels and notification
+ * helpers of the fb536 driver
+ *
+ * These have no kernel dependencies beyond the few fb536_shim.h provides,
+ * so the same code is built into the module and into the user-space
+ * benchmark and fuzzer (make ubench, make fuzz).
+ */
+
+#ifndef _FB536_CORE_H_
+#define _FB536_CORE_H_
+
+#ifdef __KERNEL__
+#include <linux/types.h>
+#include <linux/math64.h>
+#include <linux/minmax.h>
+#else
+#include "fb536_shim.h"
+#endif
+#include "fb536.h"
+
+static inline int viewports_intersect(const struct fb_viewport2 *a, const struct fb_viewport2 *b) {
+    if (a->x >= (u64)b->x + b->width || b->x >= (u64)a->x + a->width) return 0;
+    if (a->y >= (u64)b->y + b->height || b->y >= (u64)a->y + a->height) return 0;
+    return 1;
+}
+
+/* Same test FB536_IOCSETVIEWPORT applies, done in 64 bits so x + width cannot wrap */
+static inline int viewport_fits(const struct fb_viewport2 *vp, u64 w, u64 h) {
+    return (u64)vp->x + vp->width <= w && (u64)vp->y + vp->height <= h;
+}
+
+/* Viewport check done first by every I/O function */
+static inline int fb536_vp_usable(const struct fb_viewport2 *vp, u64 w, u64 h) {
+    return vp->x < w && vp->y < h && viewport_fits(vp, w, h);
+}
+
+/*
+ * Frame byte offset of byte pos of the viewport, for a frame w pixels
+ * wide. *vp_row and *vp_col get pos as viewport row and byte column.
+ */
+static inline u64 fb536_frame_off(const struct fb_viewport2 *vp, u64 w, u32 bpp, u64 pos,
+                                  u64 *vp_row, u64 *vp_col) {
+    *vp_row = div64_u64_rem(pos, (u64)vp->width * bpp, vp_col);
+    return (vp->y + *vp_row) * w * bpp + (u64)vp->x * bpp + *vp_col;
+}
+
+/* Whether a change to region (NULL: everything) concerns a file with viewport vp */
+static inline int fb536_affected(const struct fb_viewport2 *vp, const struct fb_viewport2 *region) {
+    return region == NULL || viewports_intersect(vp, region);
+}
+
+/*
+ * Whether a file last woken at *last_ns with wake interval min_ns (0:
+ * none) must wait to be woken at now; if so, *next is when it may be,
+ * and otherwise now is recorded as its last wake.
+ */
+static inline int fb536_wake_throttled(u64 *last_ns, u64 min_ns, u64 now, u64 *next) {
+    if (!min_ns)
+        return 0;
+    *next = READ_ONCE(*last_ns) + min_ns;
+    if (now < *next)
+        return 1;
+    WRITE_ONCE(*last_ns, now);
+    return 0;
+}
+
+/* RGB565 channels straddle bytes, so partial pixels cannot saturate */
+static inline int fb536_op_aligned(u32 bpp, int op, u64 pos, size_t count) {
+    return !(bpp == 2 && (op == FB536_ADD || op == FB536_SUB) && ((pos | count) & 1));
+}
+
+/*
+ * Per-format write kernels, indexed by bytes per pixel >> 1, then by
+ * operation. For 16bpp ADD and SUB n must be even.
+ */
+typedef void (*fb536_op_fn)(unsigned char *dst, const unsigned char *src, size_t n);
+extern const fb536_op_fn fb536_ops[3][6];
+
+size_t fb536_span(const struct fb_viewport2 *vp, u64 w, u64 h, u32 bpp, u64 pos, size_t count);
+void fb536_span_region(const struct fb_viewport2 *vp, u32 bpp, u64 pos, size_t count,
+                       struct fb_viewport2 *region);
+void fb536_add_damage(const struct fb_viewport2 *vp, struct fb_viewport2 *damage,
+                      const struct fb_viewport2 *region);
+/* Frame pixels [x0, x1] of row y, bytes [off, off + n), are about to change */
+typedef void (*fb536_mark_fn)(void *ctx, u64 x0, u64 x1, u64 y, u64 off, size_t n);
+void fb536_apply_span(unsigned char *frame, const struct fb_viewport2 *vp, u64 w, u32 bpp,
+                      fb536_op_fn apply, const unsigned char *src, size_t count, u64 pos,
+                      fb536_mark_fn mark, void *ctx);
+int fb536_read_span(char __user *buf, const unsigned char *frame, const struct fb_viewport2 *vp,
+                    u64 w, u32 bpp, size_t count, u64 pos);
+
+/* Wakes one file for a change to region (NULL: everything) */
+typedef void (*fb536_wake_fn)(void *file, const struct fb_viewport2 *region);
+unsigned long fb536_notify_scan(struct list_head *files, size_t node_off, size_t vp_off,
+                                const struct fb_viewport2 *region, fb536_wake_fn wake);
+
+long fb536_rle_length(const unsigned char *in, size_t len, u32 bpp);
+size_t fb536_rle_whole(const unsigned char *in, size_t len, u32 bpp);
+
+/* Longest RLE stream worth reading for npix pixels: one pixel per run, plus a cut run */
+#define FB536_RLE_MAX(npix, bpp) ((npix) * (1 + (bpp)) + 1 + 128 * (bpp))
+
+#define FB536_RLE_CHUNK 4096
+
+/* Receives n decoded bytes for viewport offset pos */
+typedef void (*fb536_emit_fn)(void *ctx, const unsigned char *src, size_t n, u64 pos);
+void fb536_rle_apply(const unsigned char *in, size_t count, u32 bpp, u64 pos,
+                     unsigned char *scratch, fb536_emit_fn emit, void *ctx);
+
+#endif /* _FB536_CORE_H_ */
@@ -0,0 +1,140 @@
+/* -*- C -*-
+ * fb536_fuzz.c -- libFuzzer target for the fb536 core
+ *
+ * The input picks a small frame, pixel format, op, viewport and offset,
+ * then a write (raw or RLE) or read is carried out by the fb536_core.c
+ * code main.c calls. RLE input is cut to whole runs the way the ioctl
+ * stages it. Every row a write touches is checked against the frame
+ * bounds, and ASan catches what the checks miss.
+ *
+ *   make fuzz && ./fb536_fuzz corpus/
+ *
+ * Built with -DFB536_FUZZ_MAIN instead, the target replays the files
+ * given on the command line, which needs no clang.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "fb536_core.h"
+
+struct fuzz_frame {
+    unsigned char *data;
+    size_t size;
+    u64 width;
+    u32 bpp;
+    struct fb_viewport2 vp;
+    fb536_op_fn apply;
+};
+
+/* Stands in for the tile marking of main.c */
+static void fuzz_mark(void *ctx, u64 x0, u64 x1, u64 y, u64 off, size_t n) {
+    struct fuzz_frame *f = ctx;
+
+    assert(y >= f->vp.y && y < (u64)f->vp.y + f->vp.height);
+    assert(x0 >= f->vp.x && x0 <= x1 && x1 < (u64)f->vp.x + f->vp.width);
+    assert(off + n <= f->size);
+}
+
+/* fb536_apply, as fb536_rle_emit calls it */
+static void fuzz_apply(void *ctx, const unsigned char *src, size_t n, u64 pos) {
+    struct fuzz_frame *f = ctx;
+
+    fb536_apply_span(f->data, &f->vp, f->width, f->bpp, f->apply, src, n, pos, fuzz_mark, f);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *in, size_t len) {
+    static const u32 bpps[] = { 1, 2, 4, 4 };
+    struct fuzz_frame f;
+    struct fb_viewport2 region, damage = { 0, 0, 0, 0 };
+    u64 h, pos;
+    size_t count;
+    int op, mode;
+
+    if (len < 12)
+        return 0;
+    f.width = in[0] % 64 + 1;
+    h = in[1] % 64 + 1;
+    f.bpp = bpps[in[2] & 3];
+    op = in[3] % 6;
+    f.vp = (struct fb_viewport2){ in[4] % 72, in[5] % 72, in[6] % 72, in[7] % 72 };
+    pos = in[8] | in[9] << 8;
+    mode = in[10] % 3;
+    in += 12;
+    len -= 12;
+
+    count = fb536_span(&f.vp, f.width, h, f.bpp, pos, len);
+    assert(count <= len);
+    if (!count)
+        return 0;
+    assert(fb536_vp_usable(&f.vp, f.width, h));
+    assert(pos + count <= (u64)f.vp.width * f.vp.height * f.bpp);
+
+    f.size = f.width * h * f.bpp;
+    f.data = calloc(1, f.size);
+    f.apply = fb536_ops[f.bpp >> 1][op];
+
+    if (mode == 2) {
+        /* ASan checks the frame reads, which use the exact frame size */
+        char *out = malloc(count);
+        int ret = fb536_read_span(out, f.data, &f.vp, f.width, f.bpp, count, pos);
+
+        assert(ret == 0);
+        (void)ret;
+        free(out);
+    } else if (mode == 1) {
+        /* Staged as fb536_write_rle does: the whole runs within what the viewport can use */
+        u64 max = FB536_RLE_MAX((u64)f.vp.width * f.vp.height, f.bpp);
+        long full = fb536_rle_length(in, len, f.bpp), total;
+        size_t n = len;
+        unsigned char scratch[FB536_RLE_CHUNK];
+
+        if (n > max) {
+            n = fb536_rle_whole(in, max, f.bpp);
+            assert(n <= max);
+        }
+        total = fb536_rle_length(in, n, f.bpp);
+        assert(n == len || total >= 0);
+        /* The cut never drops pixels the viewport would have taken */
+        assert(full < 0 || fb536_span(&f.vp, f.width, h, f.bpp, pos, total) ==
+                           fb536_span(&f.vp, f.width, h, f.bpp, pos, full));
+        if (total > 0) {
+            count = fb536_span(&f.vp, f.width, h, f.bpp, pos, total);
+            if (count && fb536_op_aligned(f.bpp, op, pos, count))
+                fb536_rle_apply(in, count, f.bpp, pos, scratch, fuzz_apply, &f);
+        }
+    } else if (fb536_op_aligned(f.bpp, op, pos, count)) {
+        fuzz_apply(&f, in, count, pos);
+    }
+
+    if (mode != 2 && count) {
+        fb536_span_region(&f.vp, f.bpp, pos, count, &region);
+        assert(viewports_intersect(&f.vp, &region));
+        assert(viewport_fits(&region, f.width, h));
+        fb536_add_damage(&f.vp, &damage, &region);
+        assert(viewport_fits(&damage, f.width, h));
+    }
+    free(f.data);
+    return 0;
+}
+
+#ifdef FB536_FUZZ_MAIN
+int main(int argc, char *argv[]) {
+    static uint8_t buf[1 << 20];
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "rb");
+        size_t n;
+
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        n = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, n);
+    }
+    return 0;
+}
+#endif
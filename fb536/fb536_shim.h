@@ -0,0 +1,115 @@
+/* -*- C -*-
+ * fb536_shim.h -- the kernel interfaces fb536_core.c and the user-space
+ * test programs built around it need, on top of libc and pthreads
+ */
+
+#ifndef _FB536_SHIM_H_
+#define _FB536_SHIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef uint64_t u64;
+typedef int64_t s64;
+
+#define U32_MAX ((u32)~0U)
+#define __user
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) ((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+#define max_t(t, a, b) ((t)(a) > (t)(b) ? (t)(a) : (t)(b))
+
+#define READ_ONCE(x) (*(const volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile __typeof__(x) *)&(x) = (v))
+
+static inline u64 div64_u64_rem(u64 a, u64 b, u64 *rem) {
+    *rem = a % b;
+    return a / b;
+}
+
+static inline u64 div64_u64(u64 a, u64 b) {
+    return a / b;
+}
+
+static inline u64 div_u64(u64 a, u32 b) {
+    return a / b;
+}
+
+#define container_of(ptr, type, member) \
+    ((type *)((char *)(ptr) - offsetof(type, member)))
+
+struct list_head {
+    struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *h) {
+    h->next = h->prev = h;
+}
+
+static inline void list_add(struct list_head *n, struct list_head *h) {
+    n->next = h->next;
+    n->prev = h;
+    h->next->prev = n;
+    h->next = n;
+}
+
+static inline void list_del(struct list_head *n) {
+    n->prev->next = n->next;
+    n->next->prev = n->prev;
+}
+
+#define list_for_each_entry(pos, head, member) \
+    for (pos = container_of((head)->next, __typeof__(*pos), member); \
+         &pos->member != (head); \
+         pos = container_of(pos->member.next, __typeof__(*pos), member))
+
+struct mutex {
+    pthread_mutex_t m;
+};
+
+#define mutex_init(l) pthread_mutex_init(&(l)->m, NULL)
+#define mutex_lock(l) pthread_mutex_lock(&(l)->m)
+#define mutex_unlock(l) pthread_mutex_unlock(&(l)->m)
+
+typedef struct {
+    pthread_mutex_t m;
+    pthread_cond_t c;
+} wait_queue_head_t;
+
+static inline void init_waitqueue_head(wait_queue_head_t *wq) {
+    pthread_mutex_init(&wq->m, NULL);
+    pthread_cond_init(&wq->c, NULL);
+}
+
+static inline void wake_up_interruptible(wait_queue_head_t *wq) {
+    pthread_mutex_lock(&wq->m);
+    pthread_cond_broadcast(&wq->c);
+    pthread_mutex_unlock(&wq->m);
+}
+
+/* Never interrupted: there are no signals to deliver */
+#define wait_event_interruptible(wq, cond) ({ \
+    pthread_mutex_lock(&(wq).m); \
+    while (!(cond)) \
+        pthread_cond_wait(&(wq).c, &(wq).m); \
+    pthread_mutex_unlock(&(wq).m); \
+    0; })
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) {
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) {
+    memcpy(to, from, n);
+    return 0;
+}
+
+#endif /* _FB536_SHIM_H_ */
@@ -0,0 +1,182 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM fb536
+
+#if !defined(_FB536_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _FB536_TRACE_H
+
+#include <linux/tracepoint.h>
+#include "fb536.h"
+
+/* Entry to fb536_read and fb536_write: pos and count in viewport bytes */
+DECLARE_EVENT_CLASS(fb536_io,
+    TP_PROTO(unsigned int minor, struct fb_viewport2 *vp, int op, u64 pos, size_t count),
+    TP_ARGS(minor, vp, op, pos, count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, x)
+        __field(u32, y)
+        __field(u32, width)
+        __field(u32, height)
+        __field(int, op)
+        __field(u64, pos)
+        __field(size_t, count)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->x = vp->x;
+        __entry->y = vp->y;
+        __entry->width = vp->width;
+        __entry->height = vp->height;
+        __entry->op = op;
+        __entry->pos = pos;
+        __entry->count = count;
+    ),
+
+    TP_printk("minor=%u viewport=%ux%u+%u+%u op=%d pos=%llu count=%zu",
+              __entry->minor, __entry->width, __entry->height, __entry->x, __entry->y,
+              __entry->op, __entry->pos, __entry->count)
+);
+
+DEFINE_EVENT(fb536_io, fb536_read_enter,
+    TP_PROTO(unsigned int minor, struct fb_viewport2 *vp, int op, u64 pos, size_t count),
+    TP_ARGS(minor, vp, op, pos, count));
+
+DEFINE_EVENT(fb536_io, fb536_write_enter,
+    TP_PROTO(unsigned int minor, struct fb_viewport2 *vp, int op, u64 pos, size_t count),
+    TP_ARGS(minor, vp, op, pos, count));
+
+/* Exit: bytes transferred or error, and time spent in the call */
+DECLARE_EVENT_CLASS(fb536_io_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, u64 duration_ns),
+    TP_ARGS(minor, ret, duration_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(ssize_t, ret)
+        __field(u64, duration_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+        __entry->duration_ns = duration_ns;
+    ),
+
+    TP_printk("minor=%u ret=%zd duration_ns=%llu",
+              __entry->minor, __entry->ret, __entry->duration_ns)
+);
+
+DEFINE_EVENT(fb536_io_exit, fb536_read_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, u64 duration_ns),
+    TP_ARGS(minor, ret, duration_ns));
+
+DEFINE_EVENT(fb536_io_exit, fb536_write_exit,
+    TP_PROTO(unsigned int minor, ssize_t ret, u64 duration_ns),
+    TP_ARGS(minor, ret, duration_ns));
+
+TRACE_EVENT(fb536_lock,
+    TP_PROTO(unsigned int minor, u64 wait_ns),
+    TP_ARGS(minor, wait_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u64, wait_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->wait_ns = wait_ns;
+    ),
+
+    TP_printk("minor=%u wait_ns=%llu", __entry->minor, __entry->wait_ns)
+);
+
+/* How a change reached a file: 0 woken, 1 deferred by its wake interval, 2 counted for its group */
+TRACE_EVENT(fb536_wake,
+    TP_PROTO(unsigned int minor, struct fb_viewport2 *vp, u64 seq, int how),
+    TP_ARGS(minor, vp, seq, how),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, x)
+        __field(u32, y)
+        __field(u32, width)
+        __field(u32, height)
+        __field(u64, seq)
+        __field(int, how)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->x = vp->x;
+        __entry->y = vp->y;
+        __entry->width = vp->width;
+        __entry->height = vp->height;
+        __entry->seq = seq;
+        __entry->how = how;
+    ),
+
+    TP_printk("minor=%u viewport=%ux%u+%u+%u seq=%llu how=%d",
+              __entry->minor, __entry->width, __entry->height, __entry->x, __entry->y,
+              __entry->seq, __entry->how)
+);
+
+TRACE_EVENT(fb536_wait_sleep,
+    TP_PROTO(unsigned int minor, struct fb_viewport2 *vp, int grouped),
+    TP_ARGS(minor, vp, grouped),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(u32, x)
+        __field(u32, y)
+        __field(u32, width)
+        __field(u32, height)
+        __field(int, grouped)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->x = vp->x;
+        __entry->y = vp->y;
+        __entry->width = vp->width;
+        __entry->height = vp->height;
+        __entry->grouped = grouped;
+    ),
+
+    TP_printk("minor=%u viewport=%ux%u+%u+%u grouped=%d",
+              __entry->minor, __entry->width, __entry->height, __entry->x, __entry->y,
+              __entry->grouped)
+);
+
+/* sleep_ns: time in FB536_IOCWAIT; latency_ns: from the wake being issued until the waiter ran */
+TRACE_EVENT(fb536_wait_wake,
+    TP_PROTO(unsigned int minor, int ret, u64 sleep_ns, u64 latency_ns),
+    TP_ARGS(minor, ret, sleep_ns, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int, minor)
+        __field(int, ret)
+        __field(u64, sleep_ns)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->minor = minor;
+        __entry->ret = ret;
+        __entry->sleep_ns = sleep_ns;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("minor=%u ret=%d sleep_ns=%llu latency_ns=%llu",
+              __entry->minor, __entry->ret, __entry->sleep_ns, __entry->latency_ns)
+);
+
+#endif /* _FB536_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE fb536_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,218 @@
+/* -*- C -*-
+ * fb536_ubench.c -- user-space benchmark of the fb536 core
+ *
+ * Drives the write and read paths of main.c through the same fb536_core.c
+ * code the module runs: clip to the viewport, copy in, apply the op row
+ * by row, and notify every file whose viewport the written rows
+ * intersect. Tiles, history and statistics are left out, and so is the
+ * wake side past the damage and throttling decision: wait groups, the
+ * timer that delivers a throttled wake later, and SIGIO and eventfd
+ * signalling. No module or VM is needed, so hot-path changes can be
+ * measured in seconds and run under perf or the sanitizers.
+ *
+ * Usage: fb536_ubench [-W width] [-H height] [-b bpp] [-n iterations]
+ *                     [-s bytes,...] [-w waiters,...]
+ *
+ * Output is CSV: one record per mode, op, viewport shape, request size
+ * and number of other open files (waiters, on disjoint 8x8 cells).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "fb536_core.h"
+
+#define MAX_LIST 16
+
+struct udev {
+    unsigned char *data;
+    u64 width, height;
+    u32 bpp;
+    struct mutex lock;
+    struct list_head file_list;
+    u64 notify_seq;
+};
+
+struct ufile {
+    struct udev *dev;
+    struct fb_viewport2 viewport, damage;
+    int op;
+    struct list_head node;
+    wait_queue_head_t wq;
+    int wake_flag;
+    u64 wake_min_ns, last_wake_ns;
+};
+
+static u64 now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* fb536_wake_desc for a file outside any wait group; throttled wakes are dropped, not deferred */
+static void uwake(void *file, const struct fb_viewport2 *region) {
+    struct ufile *f = file;
+    u64 next;
+
+    fb536_add_damage(&f->viewport, &f->damage, region);
+    if (f->wake_min_ns && fb536_wake_throttled(&f->last_wake_ns, f->wake_min_ns, now_ns(), &next))
+        return;
+    f->wake_flag = 1;
+    wake_up_interruptible(&f->wq);
+}
+
+static void unotify(struct udev *dev, struct fb_viewport2 *region) {
+    dev->notify_seq++;
+    fb536_notify_scan(&dev->file_list, offsetof(struct ufile, node), offsetof(struct ufile, viewport),
+                      region, uwake);
+}
+
+/* fb536_write_direct without tiles, history and statistics */
+static ssize_t uwrite(struct ufile *f, const unsigned char *buf, size_t count, u64 pos) {
+    struct udev *dev = f->dev;
+    struct fb_viewport2 region;
+    unsigned char *kbuf;
+
+    mutex_lock(&dev->lock);
+    count = fb536_span(&f->viewport, dev->width, dev->height, dev->bpp, pos, count);
+    if (!count || !fb536_op_aligned(dev->bpp, f->op, pos, count)) {
+        mutex_unlock(&dev->lock);
+        return count ? -EINVAL : 0;
+    }
+    kbuf = malloc(count);
+    copy_from_user(kbuf, buf, count);
+    fb536_apply_span(dev->data, &f->viewport, dev->width, dev->bpp, fb536_ops[dev->bpp >> 1][f->op],
+                     kbuf, count, pos, NULL, NULL);
+    fb536_span_region(&f->viewport, dev->bpp, pos, count, &region);
+    unotify(dev, &region);
+    free(kbuf);
+    mutex_unlock(&dev->lock);
+    return count;
+}
+
+static ssize_t uread(struct ufile *f, unsigned char *buf, size_t count, u64 pos) {
+    struct udev *dev = f->dev;
+
+    mutex_lock(&dev->lock);
+    count = fb536_span(&f->viewport, dev->width, dev->height, dev->bpp, pos, count);
+    fb536_read_span((char *)buf, dev->data, &f->viewport, dev->width, dev->bpp, count, pos);
+    mutex_unlock(&dev->lock);
+    return count;
+}
+
+static struct ufile *uopen(struct udev *dev, __u32 x, __u32 y, __u32 w, __u32 h) {
+    struct ufile *f = calloc(1, sizeof(*f));
+
+    f->dev = dev;
+    f->viewport = (struct fb_viewport2){ x, y, w, h };
+    init_waitqueue_head(&f->wq);
+    list_add(&f->node, &dev->file_list);
+    return f;
+}
+
+static void uclose(struct ufile *f) {
+    list_del(&f->node);
+    free(f);
+}
+
+static int parse_list(char *s, long *v) {
+    int n = 0;
+    char *end;
+
+    while (*s && n < MAX_LIST) {
+        v[n++] = strtol(s, &end, 0);
+        if (end == s || v[n - 1] < 0)
+            exit(2);
+        s = *end == ',' ? end + 1 : end;
+    }
+    return n;
+}
+
+int main(int argc, char *argv[]) {
+    static const char *op_names[] = { "set", "add", "sub", "and", "or", "xor" };
+    long sizes[MAX_LIST] = { 4, 256, 4096, 65536 }, waiters[MAX_LIST] = { 0, 100, 10000 };
+    int nsizes = 4, nwaiters = 3, iters = 20000, opt, s, z, k, op, mode;
+    struct udev dev = { .width = 1000, .height = 1000, .bpp = 1 };
+    struct fb_viewport2 shapes[4];
+    const char *shape_names[] = { "wide", "tall", "square", "pixel" };
+    unsigned char *buf;
+
+    while ((opt = getopt(argc, argv, "W:H:b:n:s:w:")) != -1) {
+        switch (opt) {
+        case 'W': dev.width = atol(optarg); break;
+        case 'H': dev.height = atol(optarg); break;
+        case 'b': dev.bpp = atoi(optarg) / 8; break;
+        case 'n': iters = atoi(optarg); break;
+        case 's': nsizes = parse_list(optarg, sizes); break;
+        case 'w': nwaiters = parse_list(optarg, waiters); break;
+        default:
+            fprintf(stderr, "usage: %s [-W width] [-H height] [-b 8|16|32] [-n iterations] "
+                            "[-s bytes,...] [-w waiters,...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (dev.width < 8 || dev.height < 8 || (dev.bpp != 1 && dev.bpp != 2 && dev.bpp != 4) || iters <= 0)
+        return 2;
+
+    dev.data = calloc(dev.width * dev.height, dev.bpp);
+    buf = malloc(dev.width * dev.height * dev.bpp);
+    memset(buf, 0x11, dev.width * dev.height * dev.bpp);
+    mutex_init(&dev.lock);
+    INIT_LIST_HEAD(&dev.file_list);
+
+    shapes[0] = (struct fb_viewport2){ 0, 0, dev.width, 8 };
+    shapes[1] = (struct fb_viewport2){ 0, 0, 8, dev.height };
+    shapes[2] = (struct fb_viewport2){ 0, 0, min(dev.width, 512), min(dev.height, 512) };
+    shapes[3] = (struct fb_viewport2){ 0, 0, 1, 1 };
+
+    printf("mode,op,shape,size,waiters,calls,ns_per_call,mb_s\n");
+    for (k = 0; k < nwaiters; k++) {
+        struct ufile **others = calloc(waiters[k] + 1, sizeof(*others));
+        long cells_x = dev.width / 8, cells = cells_x * (dev.height / 8), i;
+
+        for (i = 0; i < waiters[k]; i++)
+            others[i] = uopen(&dev, (i % cells % cells_x) * 8, (i % cells / cells_x) * 8, 8, 8);
+
+        for (s = 0; s < 4; s++) {
+            u64 vp_bytes = (u64)shapes[s].width * shapes[s].height * dev.bpp;
+            size_t last = 0;
+
+            for (z = 0; z < nsizes; z++) {
+                size_t size = min_t(u64, sizes[z], vp_bytes);
+
+                if (size == last || !size)
+                    continue;
+                last = size;
+                for (mode = 0; mode < 2; mode++)
+                    for (op = FB536_SET; op <= (mode ? FB536_XOR : FB536_SET); op++) {
+                        struct ufile *f = uopen(&dev, shapes[s].x, shapes[s].y,
+                                                shapes[s].width, shapes[s].height);
+                        u64 pos = 0, bytes = 0, t0, t1;
+                        int it;
+
+                        f->op = op;
+                        t0 = now_ns();
+                        for (it = 0; it < iters; it++) {
+                            ssize_t n = mode ? uwrite(f, buf, size, pos) : uread(f, buf, size, pos);
+                            bytes += n > 0 ? n : 0;
+                            pos += size;
+                            if (pos + size > vp_bytes)
+                                pos = 0;
+                        }
+                        t1 = now_ns();
+                        printf("%s,%s,%s,%zu,%ld,%d,%.1f,%.2f\n", mode ? "write" : "read",
+                               mode ? op_names[op] : "-", shape_names[s], size, waiters[k], iters,
+                               (double)(t1 - t0) / iters, bytes * 1e3 / (t1 - t0));
+                        uclose(f);
+                    }
+            }
+        }
+        for (i = 0; i < waiters[k]; i++)
+            uclose(others[i]);
+        free(others);
+    }
+    free(buf);
+    free(dev.data);
+    return 0;
+}
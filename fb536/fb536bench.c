@@ -0,0 +1,325 @@
+/* -*- C -*-
+ * fb536bench.c -- throughput and latency benchmark for the fb536 driver
+ *
+ * Runs every combination of mode (read, and write with each of the six
+ * ops), viewport shape, request size, thread count and number of minors
+ * for a fixed time and prints one record per combination: MB/s, ops/s
+ * and p50/p99/p999 latency of single read/write calls. Output is CSV, or
+ * JSON lines with -j, with a leading comment/meta record naming the
+ * kernel and module build so runs of different driver versions can be
+ * compared.
+ *
+ * Usage: fb536bench [-d ms] [-t threads,...] [-m minors,...]
+ *                   [-s bytes,...] [-M read,write] [-j]
+ *
+ * Threads are spread round-robin over /dev/fb536_0 .. /dev/fb536_<minors-1>,
+ * each with its own file and viewport, all of the same shape.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+#include <pthread.h>
+#include "fb536.h"
+
+#define MAX_LIST 16
+#define MAX_SAMPLES (1 << 18)   /* latency samples kept per thread */
+
+struct shape {
+    const char *name;
+    __u32 width, height;
+};
+
+struct list {
+    int n;
+    long v[MAX_LIST];
+};
+
+struct worker {
+    pthread_t thread;
+    int fd;
+    int write;
+    size_t size;
+    __u64 vp_bytes;
+    unsigned char *buf;
+    uint64_t ops, bytes, seen;
+    uint64_t *samples;
+    int nsamples;
+    unsigned int seed;
+    int error;
+};
+
+static const char *op_names[] = { "set", "add", "sub", "and", "or", "xor" };
+static struct fb_size2 frame;
+static pthread_barrier_t start_barrier;
+static volatile int stop;
+static int json;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int parse_list(const char *s, struct list *l) {
+    char *end;
+
+    l->n = 0;
+    while (*s && l->n < MAX_LIST) {
+        l->v[l->n++] = strtol(s, &end, 0);
+        if (end == s || l->v[l->n - 1] <= 0)
+            return -1;
+        s = *end == ',' ? end + 1 : end;
+    }
+    return *s ? -1 : 0;
+}
+
+/* Reservoir sample so long runs still report the whole interval */
+static void record(struct worker *w, uint64_t ns) {
+    w->seen++;
+    if (w->nsamples < MAX_SAMPLES) {
+        w->samples[w->nsamples++] = ns;
+    } else {
+        uint64_t j = rand_r(&w->seed) % w->seen;
+        if (j < MAX_SAMPLES)
+            w->samples[j] = ns;
+    }
+}
+
+static void *worker_main(void *arg) {
+    struct worker *w = arg;
+    __u64 off = 0;
+
+    pthread_barrier_wait(&start_barrier);
+    while (!stop) {
+        uint64_t t0 = now_ns();
+        ssize_t n = w->write ? pwrite(w->fd, w->buf, w->size, off)
+                             : pread(w->fd, w->buf, w->size, off);
+        uint64_t t1 = now_ns();
+
+        if (n < 0) {
+            w->error = errno;
+            break;
+        }
+        record(w, t1 - t0);
+        w->ops++;
+        w->bytes += n;
+        off += w->size;
+        if (off + w->size > w->vp_bytes)
+            off = 0;
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *v, size_t n, double p) {
+    size_t i;
+    if (!n)
+        return 0;
+    i = (size_t)(p * (n - 1) + 0.5);
+    return v[i];
+}
+
+/* One combination; returns -1 if the device could not be driven */
+static int run_case(int write, int op, const struct shape *sh, size_t size,
+                    int nthreads, int nminors, int duration_ms) {
+    struct worker *w = calloc(nthreads, sizeof(*w));
+    struct fb_viewport2 vp = { 0, 0, sh->width, sh->height };
+    uint64_t ops = 0, bytes = 0, *all, t0, t1;
+    size_t nall = 0;
+    double secs;
+    int i, ret = 0;
+
+    if (!w)
+        return -1;
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    stop = 0;
+
+    for (i = 0; i < nthreads; i++) {
+        char path[32];
+
+        snprintf(path, sizeof(path), "/dev/fb536_%d", i % nminors);
+        w[i].fd = open(path, O_RDWR);
+        if (w[i].fd < 0) {
+            perror(path);
+            exit(1);
+        }
+        if (ioctl(w[i].fd, FB536_IOCSETVIEWPORT2, &vp) < 0 ||
+            (write && ioctl(w[i].fd, FB536_IOCTSETOP, op) < 0)) {
+            perror("ioctl");
+            exit(1);
+        }
+        w[i].write = write;
+        w[i].size = size;
+        w[i].vp_bytes = (__u64)sh->width * sh->height * (frame.bpp / 8);
+        w[i].buf = malloc(size);
+        w[i].samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        w[i].seed = i + 1;
+        if (!w[i].buf || !w[i].samples) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+        memset(w[i].buf, 0x11, size);
+        pthread_create(&w[i].thread, NULL, worker_main, &w[i]);
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    t0 = now_ns();
+    usleep(duration_ms * 1000);
+    stop = 1;
+    for (i = 0; i < nthreads; i++)
+        pthread_join(w[i].thread, NULL);
+    t1 = now_ns();
+    pthread_barrier_destroy(&start_barrier);
+
+    for (i = 0; i < nthreads; i++)
+        nall += w[i].nsamples;
+    all = malloc((nall ? nall : 1) * sizeof(uint64_t));
+    nall = 0;
+    for (i = 0; i < nthreads; i++) {
+        if (w[i].error) {
+            fprintf(stderr, "%s: %s\n", write ? "write" : "read", strerror(w[i].error));
+            ret = -1;
+        }
+        memcpy(all + nall, w[i].samples, w[i].nsamples * sizeof(uint64_t));
+        nall += w[i].nsamples;
+        ops += w[i].ops;
+        bytes += w[i].bytes;
+        close(w[i].fd);
+        free(w[i].buf);
+        free(w[i].samples);
+    }
+    qsort(all, nall, sizeof(uint64_t), cmp_u64);
+    secs = (t1 - t0) / 1e9;
+
+    if (json)
+        printf("{\"mode\":\"%s\",\"op\":\"%s\",\"shape\":\"%s\",\"width\":%u,\"height\":%u,"
+               "\"size\":%zu,\"threads\":%d,\"minors\":%d,\"ops\":%llu,\"bytes\":%llu,"
+               "\"secs\":%.3f,\"mb_s\":%.2f,\"ops_s\":%.0f,"
+               "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu}\n",
+               write ? "write" : "read", write ? op_names[op] : "-", sh->name,
+               sh->width, sh->height, size, nthreads, nminors,
+               (unsigned long long)ops, (unsigned long long)bytes, secs,
+               bytes / secs / 1e6, ops / secs,
+               (unsigned long long)percentile(all, nall, 0.50),
+               (unsigned long long)percentile(all, nall, 0.99),
+               (unsigned long long)percentile(all, nall, 0.999));
+    else
+        printf("%s,%s,%s,%u,%u,%zu,%d,%d,%llu,%llu,%.3f,%.2f,%.0f,%llu,%llu,%llu\n",
+               write ? "write" : "read", write ? op_names[op] : "-", sh->name,
+               sh->width, sh->height, size, nthreads, nminors,
+               (unsigned long long)ops, (unsigned long long)bytes, secs,
+               bytes / secs / 1e6, ops / secs,
+               (unsigned long long)percentile(all, nall, 0.50),
+               (unsigned long long)percentile(all, nall, 0.99),
+               (unsigned long long)percentile(all, nall, 0.999));
+    fflush(stdout);
+    free(all);
+    free(w);
+    return ret;
+}
+
+static void print_header(void) {
+    char srcversion[64] = "unknown";
+    struct utsname u;
+    FILE *f;
+
+    uname(&u);
+    f = fopen("/sys/module/fb536/srcversion", "r");
+    if (f) {
+        if (fgets(srcversion, sizeof(srcversion), f))
+            srcversion[strcspn(srcversion, "\n")] = '\0';
+        fclose(f);
+    }
+    if (json) {
+        printf("{\"meta\":{\"kernel\":\"%s\",\"srcversion\":\"%s\",\"frame_width\":%u,"
+               "\"frame_height\":%u,\"bpp\":%u}}\n",
+               u.release, srcversion, frame.width, frame.height, frame.bpp);
+    } else {
+        printf("# kernel=%s srcversion=%s frame=%ux%u bpp=%u\n",
+               u.release, srcversion, frame.width, frame.height, frame.bpp);
+        printf("mode,op,shape,width,height,size,threads,minors,ops,bytes,secs,"
+               "mb_s,ops_s,p50_ns,p99_ns,p999_ns\n");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-d ms] [-t threads,...] [-m minors,...] "
+                    "[-s bytes,...] [-M read,write] [-j]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    struct list threads = { 3, { 1, 2, 4 } };
+    struct list minors = { 2, { 1, 4 } };
+    struct list sizes = { 4, { 4, 256, 4096, 65536 } };
+    int duration_ms = 1000, do_read = 1, do_write = 1;
+    struct shape shapes[4];
+    int fd, opt, s, z, t, m, op, failed = 0;
+
+    while ((opt = getopt(argc, argv, "d:t:m:s:M:j")) != -1) {
+        switch (opt) {
+        case 'd': duration_ms = atoi(optarg); break;
+        case 't': if (parse_list(optarg, &threads)) usage(argv[0]); break;
+        case 'm': if (parse_list(optarg, &minors)) usage(argv[0]); break;
+        case 's': if (parse_list(optarg, &sizes)) usage(argv[0]); break;
+        case 'M':
+            do_read = strstr(optarg, "read") != NULL;
+            do_write = strstr(optarg, "write") != NULL;
+            break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (duration_ms <= 0)
+        usage(argv[0]);
+
+    fd = open("/dev/fb536_0", O_RDWR);
+    if (fd < 0 || ioctl(fd, FB536_IOCGETSIZE2, &frame) < 0) {
+        perror("/dev/fb536_0");
+        return 1;
+    }
+    close(fd);
+
+    shapes[0] = (struct shape){ "wide", frame.width, 8 };
+    shapes[1] = (struct shape){ "tall", 8, frame.height };
+    shapes[2] = (struct shape){ "square", 512, 512 };
+    shapes[3] = (struct shape){ "pixel", 1, 1 };
+    if (shapes[2].width > frame.width || shapes[2].height > frame.height)
+        shapes[2].width = shapes[2].height = frame.width < frame.height ? frame.width : frame.height;
+
+    print_header();
+    for (s = 0; s < 4; s++) {
+        __u64 vp_bytes = (__u64)shapes[s].width * shapes[s].height * (frame.bpp / 8);
+        size_t last = 0;
+
+        for (z = 0; z < sizes.n; z++) {
+            /* Sizes beyond the viewport collapse to one whole-viewport size; parse_list kept them positive */
+            size_t size = (__u64)sizes.v[z] < vp_bytes ? (size_t)sizes.v[z] : vp_bytes;
+            if (size == last)
+                continue;
+            last = size;
+            for (t = 0; t < threads.n; t++)
+                for (m = 0; m < minors.n; m++) {
+                    if (do_read)
+                        failed |= run_case(0, 0, &shapes[s], size, threads.v[t],
+                                           minors.v[m], duration_ms);
+                    for (op = FB536_SET; do_write && op <= FB536_XOR; op++)
+                        failed |= run_case(1, op, &shapes[s], size, threads.v[t],
+                                           minors.v[m], duration_ms);
+                }
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,260 @@
+/* -*- C -*-
+ * fb536replay.c -- replay an fb536 I/O trace against the device
+ *
+ * Record on the traced system with
+ *
+ *   echo 1 > /sys/kernel/debug/fb536/0/record    (2: also hash writes)
+ *   ... workload ...
+ *   echo 0 > /sys/kernel/debug/fb536/0/record
+ *   cat /sys/kernel/debug/fb536/0/trace > trace.bin
+ *
+ * and replay with
+ *
+ *   fb536replay [-t] [-x speed] [-d /dev/fb536_N] trace.bin
+ *
+ * Every traced file gets a thread that opens, seeks, reads, writes and
+ * issues ioctls as that file did: with -t at the times the calls were
+ * entered (scaled by -x), otherwise as fast as possible. Writes carry
+ * filler bytes of the recorded length; only the metadata and a hash of
+ * the data were traced. Ioctls whose arguments point at user buffers or
+ * carry file descriptors are skipped. Waiters still blocked in
+ * FB536_IOCWAIT when everything else has finished are released with
+ * FB536_IOCRESET.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include "fb536.h"
+
+struct replay_file {
+    uint64_t id;
+    struct fb536_rec *recs;
+    size_t n, cap;
+    pthread_t thread;
+    _Atomic int in_wait;        /* blocked in FB536_IOCWAIT */
+    _Atomic int done;
+};
+
+static const char *device = "/dev/fb536_0";
+static int timed;
+static double speed = 1.0;
+static uint64_t t_first, t_start;
+static _Atomic uint64_t calls[FB536_REC_WRITE + 1], skipped, mismatched, bytes;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void wait_for(const struct fb536_rec *r) {
+    uint64_t at = t_start + (uint64_t)((r->ts_ns - t_first) / speed);
+    struct timespec ts = { at / 1000000000ull, at % 1000000000ull };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* Replays an ioctl; returns -2 when its argument cannot be reconstructed */
+static long replay_ioctl(int fd, const struct fb536_rec *r) {
+    unsigned char arg[4096];
+    unsigned int size = _IOC_SIZE(r->cmd);
+
+    if (FB536_IOC_FD_ARG(r->cmd))
+        return -2;
+    if (_IOC_DIR(r->cmd) == _IOC_NONE)
+        return ioctl(fd, r->cmd, (unsigned long)r->arg);
+    if (size > sizeof(arg))
+        return -2;
+    if (_IOC_DIR(r->cmd) & _IOC_WRITE) {
+        /* Only small structs were recorded, and user pointers in them are the traced process's */
+        if (size > sizeof(r->argbuf) || FB536_IOC_USER_PTR(r->cmd))
+            return -2;
+        memcpy(arg, r->argbuf, size);
+    }
+    return ioctl(fd, r->cmd, arg);
+}
+
+static void *replay_main(void *arg) {
+    struct replay_file *f = arg;
+    size_t bufsize = 1 << 16, i;
+    unsigned char *buf = calloc(1, bufsize);
+    int fd = -1;
+
+    for (i = 0; i < f->n; i++) {
+        const struct fb536_rec *r = &f->recs[i];
+        long ret = 0;
+
+        if (timed)
+            wait_for(r);
+        if (fd < 0 && r->type != FB536_REC_OPEN) {
+            /* Opened before recording started */
+            fd = open(device, O_RDWR);
+            if (fd < 0) {
+                perror(device);
+                break;
+            }
+        }
+        if ((r->type == FB536_REC_READ || r->type == FB536_REC_WRITE) && r->count > bufsize) {
+            free(buf);
+            bufsize = r->count;
+            buf = calloc(1, bufsize);
+        }
+        if (!buf) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+
+        switch (r->type) {
+        case FB536_REC_OPEN:
+            fd = open(device, (int)r->arg & ~(O_CREAT | O_TRUNC | O_EXCL));
+            ret = fd < 0 ? -errno : 0;
+            break;
+        case FB536_REC_RELEASE:
+            close(fd);
+            fd = -1;
+            break;
+        case FB536_REC_LLSEEK:
+            ret = lseek(fd, (off_t)r->arg, r->cmd);
+            break;
+        case FB536_REC_READ:
+            ret = pread(fd, buf, r->count, (off_t)r->arg);
+            if (ret >= 0)
+                lseek(fd, (off_t)r->arg + ret, SEEK_SET);
+            break;
+        case FB536_REC_WRITE:
+            ret = pwrite(fd, buf, r->count, (off_t)r->arg);
+            if (ret >= 0)
+                lseek(fd, (off_t)r->arg + ret, SEEK_SET);
+            break;
+        case FB536_REC_IOCTL:
+            atomic_store(&f->in_wait, r->cmd == FB536_IOCWAIT);
+            ret = replay_ioctl(fd, r);
+            atomic_store(&f->in_wait, 0);
+            if (ret == -2) {
+                skipped++;
+                continue;
+            }
+            break;
+        default:
+            skipped++;
+            continue;
+        }
+        if (ret < 0 && r->type != FB536_REC_OPEN)
+            ret = -errno;
+        if (ret > 0 && (r->type == FB536_REC_READ || r->type == FB536_REC_WRITE))
+            bytes += ret;
+        calls[r->type]++;
+        if (ret != r->ret && r->type != FB536_REC_OPEN && r->type != FB536_REC_RELEASE)
+            mismatched++;
+    }
+    if (fd >= 0)
+        close(fd);
+    free(buf);
+    atomic_store(&f->done, 1);
+    return NULL;
+}
+
+static struct replay_file *file_for(struct replay_file **files, size_t *nfiles, uint64_t id) {
+    size_t i;
+
+    for (i = 0; i < *nfiles; i++)
+        if ((*files)[i].id == id)
+            return &(*files)[i];
+    *files = realloc(*files, (*nfiles + 1) * sizeof(**files));
+    memset(&(*files)[*nfiles], 0, sizeof(**files));
+    (*files)[*nfiles].id = id;
+    return &(*files)[(*nfiles)++];
+}
+
+int main(int argc, char *argv[]) {
+    static const char *names[] = { "", "open", "release", "ioctl", "llseek", "read", "write" };
+    struct replay_file *files = NULL;
+    struct fb536_rec r;
+    size_t nfiles = 0, nrecs = 0, i;
+    uint64_t t_end;
+    int opt, fd, running;
+    FILE *in;
+
+    while ((opt = getopt(argc, argv, "tx:d:")) != -1) {
+        switch (opt) {
+        case 't': timed = 1; break;
+        case 'x': speed = atof(optarg); break;
+        case 'd': device = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-t] [-x speed] [-d device] trace\n", argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || speed <= 0) {
+        fprintf(stderr, "usage: %s [-t] [-x speed] [-d device] trace\n", argv[0]);
+        return 2;
+    }
+
+    in = fopen(argv[optind], "rb");
+    if (!in) {
+        perror(argv[optind]);
+        return 1;
+    }
+    while (fread(&r, sizeof(r), 1, in) == 1) {
+        struct replay_file *f = file_for(&files, &nfiles, r.file);
+
+        if (f->n == f->cap) {
+            f->cap = f->cap ? f->cap * 2 : 64;
+            f->recs = realloc(f->recs, f->cap * sizeof(r));
+        }
+        f->recs[f->n++] = r;
+        /* Records queue as calls finish but carry their entry times */
+        if (!nrecs++ || r.ts_ns < t_first)
+            t_first = r.ts_ns;
+    }
+    fclose(in);
+    if (!nrecs) {
+        fprintf(stderr, "%s: no records\n", argv[optind]);
+        return 1;
+    }
+
+    t_start = now_ns();
+    for (i = 0; i < nfiles; i++)
+        pthread_create(&files[i].thread, NULL, replay_main, &files[i]);
+
+    /* Once every unfinished file waits, nothing in the trace is left to wake them */
+    fd = open(device, O_RDWR);
+    do {
+        int waiting = 0;
+
+        usleep(10000);
+        running = 0;
+        for (i = 0; i < nfiles; i++) {
+            running += !atomic_load(&files[i].done);
+            waiting += atomic_load(&files[i].in_wait);
+        }
+        if (running && waiting == running && fd >= 0)
+            ioctl(fd, FB536_IOCRESET);
+    } while (running);
+    t_end = now_ns();
+    if (fd >= 0)
+        close(fd);
+    for (i = 0; i < nfiles; i++) {
+        pthread_join(files[i].thread, NULL);
+        free(files[i].recs);
+    }
+
+    printf("records %zu files %zu secs %.3f\n", nrecs, nfiles, (t_end - t_start) / 1e9);
+    for (i = FB536_REC_OPEN; i <= FB536_REC_WRITE; i++)
+        printf("%s %llu\n", names[i], (unsigned long long)calls[i]);
+    printf("bytes %llu\nskipped %llu\nresult_mismatches %llu\nops_per_sec %.0f\n",
+           (unsigned long long)bytes, (unsigned long long)skipped,
+           (unsigned long long)mismatched, nrecs / ((t_end - t_start) / 1e9));
+    free(files);
+    return 0;
+}
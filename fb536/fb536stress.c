@@ -0,0 +1,331 @@
+/* -*- C -*-
+ * fb536stress.c -- concurrency stress test with a linearizability check
+ *
+ * On each minor under test the frame is split into horizontal bands, one
+ * per writer thread. A writer changes its viewport to a random rectangle
+ * of its band and writes it with a random op, keeping a sequential model
+ * of the band. Before each write it publishes the hash the band will have
+ * afterwards, and after it the band's new version number, so every band
+ * has a history of states with known version numbers.
+ *
+ * Reader threads read whole bands. A read runs under dev->lock, so it has
+ * to return the state of the band at some version between the one current
+ * when the read started and the one after the last completed when it
+ * returned; anything else is a linearizability violation. A third thread
+ * keeps resizing the frame up and back down with FB536_IOCTRESIZE while
+ * writers run, which must preserve the bands, and issues FB536_IOCRESET,
+ * which it models as a write of zeros to every band. At the end every band
+ * must equal its model exactly.
+ *
+ * Usage: fb536stress [-m minors] [-w writers] [-r readers] [-d seconds]
+ *
+ * Exits 1 if any check failed. Prints the operations done per second.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include "fb536.h"
+
+#define WIDTH 256
+#define HEIGHT 256
+#define RING 4096       /* band states remembered */
+
+struct band {
+    int y, height;
+    unsigned char *model, *next;
+    _Atomic uint64_t version;
+    _Atomic uint64_t hashes[RING];  /* band hash by version % RING */
+};
+
+struct minor {
+    int index;
+    char path[32];
+    int nbands;
+    struct band *bands;
+    pthread_rwlock_t reset_lock;    /* writers share it, resets take it alone */
+    _Atomic uint64_t writes, reads, resets, resizes, violations, inconclusive;
+};
+
+struct worker {
+    pthread_t thread;
+    struct minor *m;
+    int id;
+    unsigned int seed;
+};
+
+static _Atomic int stop;
+
+static uint64_t hash(const unsigned char *p, size_t n) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    while (n--)
+        h = (h ^ *p++) * 0x100000001b3ull;
+    return h;
+}
+
+static int open_dev(struct minor *m) {
+    int fd = open(m->path, O_RDWR);
+    if (fd < 0) {
+        perror(m->path);
+        exit(1);
+    }
+    return fd;
+}
+
+static void fail(struct minor *m, const char *what) {
+    fprintf(stderr, "%s: %s\n", m->path, what);
+    m->violations++;
+}
+
+/* Reference semantics of the 8bpp ops, independent of the driver code */
+static void model_apply(unsigned char *d, const unsigned char *s, size_t n, int op) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+        switch (op) {
+        case FB536_SET: d[i] = s[i]; break;
+        case FB536_ADD: d[i] = d[i] + s[i] > 255 ? 255 : d[i] + s[i]; break;
+        case FB536_SUB: d[i] = d[i] > s[i] ? d[i] - s[i] : 0; break;
+        case FB536_AND: d[i] &= s[i]; break;
+        case FB536_OR:  d[i] |= s[i]; break;
+        case FB536_XOR: d[i] ^= s[i]; break;
+        }
+    }
+}
+
+static void *writer_main(void *arg) {
+    struct worker *w = arg;
+    struct minor *m = w->m;
+    struct band *b = &m->bands[w->id];
+    unsigned char buf[WIDTH * HEIGHT];
+    int fd = open_dev(m);
+
+    while (!atomic_load(&stop)) {
+        struct fb_viewport2 vp;
+        uint64_t v;
+        size_t len, i, row;
+        int op = rand_r(&w->seed) % 6;
+
+        vp.width = 1 + rand_r(&w->seed) % WIDTH;
+        vp.height = 1 + rand_r(&w->seed) % b->height;
+        vp.x = rand_r(&w->seed) % (WIDTH - vp.width + 1);
+        vp.y = b->y + rand_r(&w->seed) % (b->height - vp.height + 1);
+        len = (size_t)vp.width * vp.height;
+        for (i = 0; i < len; i++)
+            buf[i] = rand_r(&w->seed);
+
+        if (ioctl(fd, FB536_IOCSETVIEWPORT2, &vp) || ioctl(fd, FB536_IOCTSETOP, op)) {
+            fail(m, "viewport or op change failed");
+            break;
+        }
+
+        pthread_rwlock_rdlock(&m->reset_lock);
+        memcpy(b->next, b->model, (size_t)WIDTH * b->height);
+        for (row = 0; row < vp.height; row++)
+            model_apply(b->next + (vp.y - b->y + row) * WIDTH + vp.x, buf + row * vp.width,
+                        vp.width, op);
+        v = atomic_load(&b->version);
+        atomic_store(&b->hashes[(v + 1) % RING], hash(b->next, (size_t)WIDTH * b->height));
+        if (pwrite(fd, buf, len, 0) != (ssize_t)len)
+            fail(m, "short or failed write");
+        memcpy(b->model, b->next, (size_t)WIDTH * b->height);
+        atomic_store(&b->version, v + 1);
+        pthread_rwlock_unlock(&m->reset_lock);
+        m->writes++;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *reader_main(void *arg) {
+    struct worker *w = arg;
+    struct minor *m = w->m;
+    unsigned char buf[WIDTH * HEIGHT];
+    int fd = open_dev(m);
+
+    while (!atomic_load(&stop)) {
+        struct band *b = &m->bands[rand_r(&w->seed) % m->nbands];
+        struct fb_viewport2 vp = { 0, b->y, WIDTH, b->height };
+        size_t len = (size_t)WIDTH * b->height;
+        uint64_t v0, v1, v, h;
+        int ok = 0;
+
+        if (ioctl(fd, FB536_IOCSETVIEWPORT2, &vp)) {
+            fail(m, "reader viewport change failed");
+            break;
+        }
+        v0 = atomic_load(&b->version);
+        if (pread(fd, buf, len, 0) != (ssize_t)len) {
+            fail(m, "short or failed read");
+            break;
+        }
+        v1 = atomic_load(&b->version);
+        m->reads++;
+        if (v1 + 1 - v0 >= RING) {
+            m->inconclusive++;
+            continue;
+        }
+        h = hash(buf, len);
+        for (v = v0; v <= v1 + 1 && !ok; v++)
+            ok = atomic_load(&b->hashes[v % RING]) == h;
+        if (!ok) {
+            char msg[96];
+            snprintf(msg, sizeof(msg), "band at row %d read matches no state in versions %llu..%llu",
+                     b->y, (unsigned long long)v0, (unsigned long long)v1 + 1);
+            fail(m, msg);
+        }
+    }
+    close(fd);
+    return NULL;
+}
+
+/* Resizes up and back down while writers run; resets with writers held off */
+static void *chaos_main(void *arg) {
+    struct worker *w = arg;
+    struct minor *m = w->m;
+    int fd = open_dev(m), i;
+
+    while (!atomic_load(&stop)) {
+        usleep(1000 + rand_r(&w->seed) % 20000);
+        if (rand_r(&w->seed) % 3) {
+            if (ioctl(fd, FB536_IOCTRESIZE, (WIDTH + 64) << 16 | (HEIGHT + 64)) ||
+                ioctl(fd, FB536_IOCTRESIZE, WIDTH << 16 | HEIGHT))
+                fail(m, "resize failed");
+            m->resizes++;
+            continue;
+        }
+        pthread_rwlock_wrlock(&m->reset_lock);
+        for (i = 0; i < m->nbands; i++) {
+            struct band *b = &m->bands[i];
+            memset(b->next, 0, (size_t)WIDTH * b->height);
+            atomic_store(&b->hashes[(atomic_load(&b->version) + 1) % RING],
+                         hash(b->next, (size_t)WIDTH * b->height));
+        }
+        if (ioctl(fd, FB536_IOCRESET))
+            fail(m, "reset failed");
+        for (i = 0; i < m->nbands; i++) {
+            struct band *b = &m->bands[i];
+            memset(b->model, 0, (size_t)WIDTH * b->height);
+            atomic_store(&b->version, atomic_load(&b->version) + 1);
+        }
+        pthread_rwlock_unlock(&m->reset_lock);
+        m->resets++;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void setup_minor(struct minor *m, int index, int nwriters) {
+    struct fb_size2 sz = { WIDTH, HEIGHT, 0, FB536_BPP_8 };
+    pthread_rwlockattr_t attr;
+    int fd, i;
+
+    m->index = index;
+    snprintf(m->path, sizeof(m->path), "/dev/fb536_%d", index);
+    fd = open_dev(m);
+    if (ioctl(fd, FB536_IOCSETSIZE2, &sz) || ioctl(fd, FB536_IOCRESET)) {
+        perror("setup");
+        exit(1);
+    }
+    close(fd);
+
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&m->reset_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    m->nbands = nwriters;
+    m->bands = calloc(nwriters, sizeof(*m->bands));
+    for (i = 0; i < nwriters; i++) {
+        struct band *b = &m->bands[i];
+        b->y = i * (HEIGHT / nwriters);
+        b->height = HEIGHT / nwriters;
+        b->model = calloc(WIDTH, b->height);
+        b->next = calloc(WIDTH, b->height);
+        atomic_store(&b->hashes[0], hash(b->model, (size_t)WIDTH * b->height));
+    }
+}
+
+/* With everything stopped the frame must equal the models */
+static void final_check(struct minor *m) {
+    unsigned char buf[WIDTH * HEIGHT];
+    struct fb_viewport2 vp = { 0, 0, WIDTH, HEIGHT };
+    int fd = open_dev(m), i;
+
+    if (ioctl(fd, FB536_IOCSETVIEWPORT2, &vp) || pread(fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        fail(m, "final read failed");
+    } else {
+        for (i = 0; i < m->nbands; i++) {
+            struct band *b = &m->bands[i];
+            if (memcmp(buf + (size_t)b->y * WIDTH, b->model, (size_t)WIDTH * b->height)) {
+                char msg[64];
+                snprintf(msg, sizeof(msg), "band at row %d differs from its model", b->y);
+                fail(m, msg);
+            }
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    int nminors = 1, nwriters = 4, nreaders = 4, secs = 10, opt, i, j, n = 0;
+    struct minor *minors;
+    struct worker *workers;
+    uint64_t violations = 0;
+
+    while ((opt = getopt(argc, argv, "m:w:r:d:")) != -1) {
+        switch (opt) {
+        case 'm': nminors = atoi(optarg); break;
+        case 'w': nwriters = atoi(optarg); break;
+        case 'r': nreaders = atoi(optarg); break;
+        case 'd': secs = atoi(optarg); break;
+        default:
+            fprintf(stderr, "usage: %s [-m minors] [-w writers] [-r readers] [-d seconds]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (nminors < 1 || nwriters < 1 || nwriters > HEIGHT || nreaders < 0 || secs < 1)
+        return 2;
+
+    minors = calloc(nminors, sizeof(*minors));
+    workers = calloc((size_t)nminors * (nwriters + nreaders + 1), sizeof(*workers));
+    for (i = 0; i < nminors; i++)
+        setup_minor(&minors[i], i, nwriters);
+
+    for (i = 0; i < nminors; i++) {
+        for (j = 0; j < nwriters + nreaders + 1; j++, n++) {
+            workers[n].m = &minors[i];
+            workers[n].id = j;
+            workers[n].seed = n * 7919 + 1;
+            pthread_create(&workers[n].thread, NULL,
+                           j < nwriters ? writer_main : j < nwriters + nreaders ? reader_main : chaos_main,
+                           &workers[n]);
+        }
+    }
+    sleep(secs);
+    atomic_store(&stop, 1);
+    for (i = 0; i < n; i++)
+        pthread_join(workers[i].thread, NULL);
+
+    printf("minor,writes,reads,resets,resizes,inconclusive,violations,writes_per_s,reads_per_s\n");
+    for (i = 0; i < nminors; i++) {
+        struct minor *m = &minors[i];
+
+        final_check(m);
+        printf("%d,%llu,%llu,%llu,%llu,%llu,%llu,%.0f,%.0f\n", i,
+               (unsigned long long)m->writes, (unsigned long long)m->reads,
+               (unsigned long long)m->resets, (unsigned long long)m->resizes,
+               (unsigned long long)m->inconclusive, (unsigned long long)m->violations,
+               (double)m->writes / secs, (double)m->reads / secs);
+        violations += m->violations;
+    }
+    printf("%s\n", violations ? "FAILED" : "PASSED");
+    return violations ? 1 : 0;
+}
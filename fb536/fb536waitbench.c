@@ -0,0 +1,411 @@
+/* -*- C -*-
+ * fb536waitbench.c -- FB536_IOCWAIT scalability benchmark
+ *
+ * Opens N waiter files on /dev/fb536_0, each blocking in FB536_IOCWAIT on
+ * an 8x8 cell of the frame, while writer threads write whole cells at a
+ * fixed total rate. Overlap patterns decide how many waiters share a cell:
+ *
+ *   disjoint     every waiter has a cell of its own
+ *   full         all waiters share one cell
+ *   overlap:K    groups of K waiters share a cell
+ *
+ * For each waiter count and pattern it reports, as CSV or JSON lines (-j):
+ *
+ *   wakeups      FB536_IOCWAIT returns
+ *   spurious     returns with no write to the waiter's cell since it
+ *                started waiting
+ *   coalesced    writes to a cell beyond the first that a single return
+ *                covered, including ones made before the waiter slept
+ *   missed       waiters that stayed asleep through a final write to
+ *                their cell made after the writers stopped
+ *   wake_p*      write-to-wake latency, from just before the write call
+ *                to the waiter running again
+ *   write_p*     writer call latency, and slowdown of its p50 against a
+ *                run with no waiters
+ *
+ * Usage: fb536waitbench [-n waiters,...] [-p pattern,...] [-r writes/s]
+ *                       [-w writers] [-d ms] [-j]
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include "fb536.h"
+
+#define DEVICE "/dev/fb536_0"
+#define CELL 8
+#define MAX_LIST 16
+#define MAX_SAMPLES (1 << 20)
+#define MISS_TIMEOUT_MS 1000
+
+struct cell {
+    _Atomic uint64_t count;     /* writes made to the cell */
+    _Atomic uint64_t last_ns;   /* when the latest one was started */
+};
+
+struct waiter {
+    pthread_t thread;
+    int fd;
+    int cell;
+    _Atomic int asleep;         /* about to enter or inside FB536_IOCWAIT */
+    _Atomic uint64_t woken;
+};
+
+struct writer {
+    pthread_t thread;
+    int id;
+    uint64_t *lat;
+    size_t nlat;
+};
+
+struct samples {
+    uint64_t *v;
+    _Atomic size_t n;
+};
+
+static struct fb_size2 frame;
+static struct cell *cells;
+static int ncells, cells_x;
+static int nwriters = 1;
+static long rate = 1000;
+static _Atomic int stop;
+static _Atomic uint64_t wakeups, spurious, coalesced;
+static struct samples wake_lat;
+static int json;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t ns) {
+    struct timespec ts = { ns / 1000000000ull, ns % 1000000000ull };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void cell_viewport(int c, struct fb_viewport2 *vp) {
+    vp->x = (c % cells_x) * CELL;
+    vp->y = (c / cells_x) * CELL;
+    vp->width = CELL;
+    vp->height = CELL;
+}
+
+static int open_cell(int c) {
+    struct fb_viewport2 vp;
+    int fd = open(DEVICE, O_RDWR);
+
+    cell_viewport(c, &vp);
+    if (fd < 0 || ioctl(fd, FB536_IOCSETVIEWPORT2, &vp) < 0) {
+        perror(DEVICE);
+        exit(1);
+    }
+    return fd;
+}
+
+static void add_sample(struct samples *s, uint64_t ns) {
+    size_t i = atomic_fetch_add(&s->n, 1);
+    if (i < MAX_SAMPLES)
+        s->v[i] = ns;
+}
+
+static void *waiter_main(void *arg) {
+    struct waiter *w = arg;
+    struct cell *c = &cells[w->cell];
+
+    while (!atomic_load(&stop)) {
+        uint64_t before = atomic_load(&c->count), after;
+
+        atomic_store(&w->asleep, 1);
+        if (ioctl(w->fd, FB536_IOCWAIT) < 0) {
+            atomic_store(&w->asleep, 0);
+            if (errno == EINTR)
+                continue;
+            perror("FB536_IOCWAIT");
+            break;
+        }
+        atomic_store(&w->asleep, 0);
+        after = atomic_load(&c->count);
+        atomic_fetch_add(&w->woken, 1);
+        atomic_fetch_add(&wakeups, 1);
+        if (after == before) {
+            atomic_fetch_add(&spurious, 1);
+            continue;
+        }
+        coalesced += after - before - 1;
+        add_sample(&wake_lat, now_ns() - atomic_load(&c->last_ns));
+    }
+    return NULL;
+}
+
+static int write_cell(int fd, int c) {
+    static const unsigned char buf[CELL * CELL * 4];
+    size_t len = CELL * CELL * (frame.bpp / 8);
+
+    atomic_store(&cells[c].last_ns, now_ns());
+    atomic_fetch_add(&cells[c].count, 1);
+    return pwrite(fd, buf, len, 0) == (ssize_t)len ? 0 : -1;
+}
+
+/* Writes round-robin over the cells in use, at this writer's share of rate */
+static void *writer_main(void *arg) {
+    struct writer *wr = arg;
+    uint64_t period = 1000000000ull * nwriters / rate, next = now_ns();
+    int i, c = wr->id % ncells;
+    int *fds = malloc(ncells * sizeof(int));
+
+    for (i = 0; i < ncells; i++)
+        fds[i] = -1;
+    while (!atomic_load(&stop)) {
+        uint64_t t0;
+
+        if (fds[c] < 0)
+            fds[c] = open_cell(c);
+        t0 = now_ns();
+        if (write_cell(fds[c], c) < 0) {
+            perror("write");
+            break;
+        }
+        if (wr->nlat < MAX_SAMPLES)
+            wr->lat[wr->nlat++] = now_ns() - t0;
+        c = (c + nwriters) % ncells;
+        next += period;
+        sleep_until(next);
+    }
+    for (i = 0; i < ncells; i++)
+        if (fds[i] >= 0)
+            close(fds[i]);
+    free(fds);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(uint64_t *v, size_t n, double p) {
+    return n ? v[(size_t)(p * (n - 1) + 0.5)] : 0;
+}
+
+/* Run the writers for duration_ms; fills lat/nlat with all write latencies */
+static void run_writers(int duration_ms, uint64_t *lat, size_t *nlat) {
+    struct writer *wr = calloc(nwriters, sizeof(*wr));
+    int i;
+
+    atomic_store(&stop, 0);
+    for (i = 0; i < nwriters; i++) {
+        wr[i].id = i;
+        wr[i].lat = malloc(MAX_SAMPLES * sizeof(uint64_t));
+        pthread_create(&wr[i].thread, NULL, writer_main, &wr[i]);
+    }
+    usleep(duration_ms * 1000);
+    atomic_store(&stop, 1);
+    *nlat = 0;
+    for (i = 0; i < nwriters; i++) {
+        pthread_join(wr[i].thread, NULL);
+        memcpy(lat + *nlat, wr[i].lat, wr[i].nlat * sizeof(uint64_t));
+        *nlat += wr[i].nlat;
+        free(wr[i].lat);
+    }
+    qsort(lat, *nlat, sizeof(uint64_t), cmp_u64);
+    free(wr);
+}
+
+static void run_case(const char *pattern, int share, int n, int duration_ms) {
+    struct waiter *w = calloc(n, sizeof(*w));
+    uint64_t *wlat = malloc((size_t)nwriters * MAX_SAMPLES * sizeof(uint64_t));
+    uint64_t *base = malloc((size_t)nwriters * MAX_SAMPLES * sizeof(uint64_t));
+    size_t nwlat, nbase, nwake;
+    uint64_t base_p50, missed = 0, deadline;
+    pthread_attr_t attr;
+    int i, fd, running;
+
+    ncells = (n + share - 1) / share;
+    if (ncells > cells_x * (int)(frame.height / CELL)) {
+        fprintf(stderr, "%s: %d waiters need more than %d cells\n", pattern, n,
+                cells_x * (int)(frame.height / CELL));
+        exit(1);
+    }
+    cells = calloc(ncells, sizeof(*cells));
+
+    /* Baseline writer latency with no waiters on the cells */
+    run_writers(duration_ms / 2 > 0 ? duration_ms / 2 : 1, base, &nbase);
+    base_p50 = percentile(base, nbase, 0.5);
+
+    atomic_store(&wakeups, 0);
+    atomic_store(&spurious, 0);
+    atomic_store(&coalesced, 0);
+    atomic_store(&wake_lat.n, 0);
+    atomic_store(&stop, 0);
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 * 1024);
+    for (i = 0; i < n; i++) {
+        w[i].cell = i / share;
+        w[i].fd = open_cell(w[i].cell);
+        if (pthread_create(&w[i].thread, &attr, waiter_main, &w[i])) {
+            fprintf(stderr, "cannot start waiter %d\n", i);
+            exit(1);
+        }
+    }
+    pthread_attr_destroy(&attr);
+    usleep(100000);
+
+    run_writers(duration_ms, wlat, &nwlat);
+
+    /* Missed wakeups: with the writers stopped, one write to every cell must wake all */
+    deadline = now_ns() + MISS_TIMEOUT_MS * 1000000ull;
+    do {
+        running = 0;
+        for (i = 0; i < n; i++)
+            running += !atomic_load(&w[i].asleep);
+        if (running)
+            usleep(1000);
+    } while (running && now_ns() < deadline);
+    usleep(10000);
+    for (i = 0; i < n; i++)
+        atomic_store(&w[i].woken, 0);
+    fd = open(DEVICE, O_RDWR);
+    for (i = 0; i < ncells; i++) {
+        int cfd = open_cell(i);
+        write_cell(cfd, i);
+        close(cfd);
+    }
+    deadline = now_ns() + MISS_TIMEOUT_MS * 1000000ull;
+    do {
+        running = 0;
+        for (i = 0; i < n; i++)
+            running += !atomic_load(&w[i].woken);
+        if (running)
+            usleep(1000);
+    } while (running && now_ns() < deadline);
+    missed = running;
+
+    /* FB536_IOCRESET wakes every file; repeat until all waiters saw stop */
+    atomic_store(&stop, 1);
+    for (i = 0; i < n; i++) {
+        while (pthread_tryjoin_np(w[i].thread, NULL) != 0) {
+            ioctl(fd, FB536_IOCRESET);
+            usleep(100);
+        }
+        close(w[i].fd);
+    }
+    close(fd);
+
+    nwake = atomic_load(&wake_lat.n);
+    if (nwake > MAX_SAMPLES)
+        nwake = MAX_SAMPLES;
+    qsort(wake_lat.v, nwake, sizeof(uint64_t), cmp_u64);
+
+    if (json)
+        printf("{\"pattern\":\"%s\",\"waiters\":%d,\"cells\":%d,\"writers\":%d,\"rate\":%ld,"
+               "\"writes\":%zu,\"wakeups\":%llu,\"spurious\":%llu,\"coalesced\":%llu,"
+               "\"missed\":%llu,\"wake_p50_ns\":%llu,\"wake_p99_ns\":%llu,\"wake_p999_ns\":%llu,"
+               "\"write_p50_ns\":%llu,\"write_p99_ns\":%llu,\"write_slowdown\":%.2f}\n",
+               pattern, n, ncells, nwriters, rate, nwlat,
+               (unsigned long long)wakeups, (unsigned long long)spurious,
+               (unsigned long long)coalesced, (unsigned long long)missed,
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.50),
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.99),
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.999),
+               (unsigned long long)percentile(wlat, nwlat, 0.50),
+               (unsigned long long)percentile(wlat, nwlat, 0.99),
+               base_p50 ? (double)percentile(wlat, nwlat, 0.50) / base_p50 : 0.0);
+    else
+        printf("%s,%d,%d,%d,%ld,%zu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%llu,%.2f\n",
+               pattern, n, ncells, nwriters, rate, nwlat,
+               (unsigned long long)wakeups, (unsigned long long)spurious,
+               (unsigned long long)coalesced, (unsigned long long)missed,
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.50),
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.99),
+               (unsigned long long)percentile(wake_lat.v, nwake, 0.999),
+               (unsigned long long)percentile(wlat, nwlat, 0.50),
+               (unsigned long long)percentile(wlat, nwlat, 0.99),
+               base_p50 ? (double)percentile(wlat, nwlat, 0.50) / base_p50 : 0.0);
+    fflush(stdout);
+
+    free(cells);
+    free(base);
+    free(wlat);
+    free(w);
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n waiters,...] [-p disjoint|full|overlap:K,...] "
+                    "[-r writes/s] [-w writers] [-d ms] [-j]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    long counts[MAX_LIST] = { 1, 10, 100, 1000, 10000 };
+    int ncounts = 5, duration_ms = 2000, opt, i, fd;
+    char *patterns = strdup("disjoint,full,overlap:8"), *p, *save;
+    struct rlimit rl;
+
+    while ((opt = getopt(argc, argv, "n:p:r:w:d:j")) != -1) {
+        switch (opt) {
+        case 'n':
+            ncounts = 0;
+            for (p = strtok_r(optarg, ",", &save); p && ncounts < MAX_LIST; p = strtok_r(NULL, ",", &save))
+                counts[ncounts++] = atol(p);
+            break;
+        case 'p': patterns = optarg; break;
+        case 'r': rate = atol(optarg); break;
+        case 'w': nwriters = atoi(optarg); break;
+        case 'd': duration_ms = atoi(optarg); break;
+        case 'j': json = 1; break;
+        default: usage(argv[0]);
+        }
+    }
+    if (rate <= 0 || nwriters <= 0 || duration_ms <= 0 || !ncounts)
+        usage(argv[0]);
+    for (i = 0; i < ncounts; i++)
+        if (counts[i] <= 0)
+            usage(argv[0]);
+
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0 || ioctl(fd, FB536_IOCGETSIZE2, &frame) < 0) {
+        perror(DEVICE);
+        return 1;
+    }
+    close(fd);
+    cells_x = frame.width / CELL;
+
+    /* One file per waiter and per cell a writer touches */
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+
+    wake_lat.v = malloc(MAX_SAMPLES * sizeof(uint64_t));
+    if (json)
+        printf("{\"meta\":{\"frame_width\":%u,\"frame_height\":%u,\"bpp\":%u,\"cell\":%d}}\n",
+               frame.width, frame.height, frame.bpp, CELL);
+    else
+        printf("pattern,waiters,cells,writers,rate,writes,wakeups,spurious,coalesced,missed,"
+               "wake_p50_ns,wake_p99_ns,wake_p999_ns,write_p50_ns,write_p99_ns,write_slowdown\n");
+
+    for (p = strtok_r(patterns, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+        int share = 0;
+
+        if (!strcmp(p, "disjoint"))
+            share = 1;
+        else if (!strncmp(p, "overlap:", 8) && atoi(p + 8) > 0)
+            share = atoi(p + 8);
+        else if (strcmp(p, "full"))
+            usage(argv[0]);
+        for (i = 0; i < ncounts; i++)
+            run_case(p, strcmp(p, "full") ? share : counts[i], counts[i], duration_ms);
+    }
+    return 0;
+}
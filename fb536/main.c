@@ -10,65 +10,1320 @@
 #include <linux/cdev.h>
 #include <linux/uaccess.h>
 #include <linux/mutex.h>
+#include <linux/seqlock.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/kthread.h>
+#include <linux/cpumask.h>
+#include <linux/poll.h>
+#include <linux/numa.h>
+#include <linux/nodemask.h>
+#include <linux/gfp.h>
+#include <linux/shmem_fs.h>
+#include <linux/file.h>
+#include <linux/pagemap.h>
+#include <linux/cred.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
+#include <linux/scatterlist.h>
 #include <linux/vmalloc.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
 #include <linux/list.h>
+#include <linux/math64.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/eventfd.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/kfifo.h>
+#include <linux/crc32.h>
 #include "fb536.h"
+#include "fb536_core.h"
+
+#define CREATE_TRACE_POINTS
+#include "fb536_trace.h"
 
 #define FB536_MAJOR 0
 #define FB536_MINORS 4
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Based on scullc by Alessandro Rubini and Jonathan Corbet");
+MODULE_IMPORT_NS(DMA_BUF);
 
 static int major = FB536_MAJOR;
 static int numminors = FB536_MINORS;
 static int width = 1000;
 static int height = 1000;
+static unsigned long maxframe_mb = 4096;
+static int history = 0;
+static unsigned long history_mb = 64;
 
 module_param(major, int, S_IRUGO);
 module_param(numminors, int, S_IRUGO);
 module_param(width, int, S_IRUGO);
 module_param(height, int, S_IRUGO);
+module_param(maxframe_mb, ulong, S_IRUGO);
+MODULE_PARM_DESC(maxframe_mb, "Largest frame FB536_IOCSETSIZE2 may allocate, in MiB");
+module_param(history, int, S_IRUGO);
+MODULE_PARM_DESC(history, "Frame versions each minor keeps for FB536_IOCREADGEN (0 = off)");
+module_param(history_mb, ulong, S_IRUGO);
+MODULE_PARM_DESC(history_mb, "Memory each minor may spend on frame history, in MiB");
+static unsigned int record_entries = 65536;
+module_param(record_entries, uint, S_IRUGO);
+MODULE_PARM_DESC(record_entries, "Records the debugfs trace ring of each minor holds");
+static int async_cpu = -1;
+module_param(async_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(async_cpu, "CPU the async write workers run on (-1 = any)");
+static unsigned long async_queue_kb = 16384;
+module_param(async_queue_kb, ulong, S_IRUGO);
+MODULE_PARM_DESC(async_queue_kb, "Bytes of async writes a file may have queued, in KiB");
+
+#define FB536_NODE_INTERLEAVE (-2)
+#define FB536_MAX_NODE_PARAMS 64
+
+static int node = NUMA_NO_NODE;
+module_param(node, int, S_IRUGO);
+MODULE_PARM_DESC(node, "NUMA node of the frames: -1 = the allocating task's, -2 = interleaved over all nodes");
+static int minor_node[FB536_MAX_NODE_PARAMS];
+static int minor_node_count;
+module_param_array(minor_node, int, &minor_node_count, S_IRUGO);
+MODULE_PARM_DESC(minor_node, "Per-minor node, overriding node for the minors listed");
+static bool hugepages = true;
+module_param(hugepages, bool, S_IRUGO);
+MODULE_PARM_DESC(hugepages, "Back frames not bound to a node with huge pages where possible");
+static bool shmem = false;
+module_param(shmem, bool, S_IRUGO);
+MODULE_PARM_DESC(shmem, "Back frames with shmem files, which FB536_IOCSHMEMFD exports and cold minors swap");
+static unsigned int shmem_cold_secs = 30;
+module_param(shmem_cold_secs, uint, S_IRUGO);
+MODULE_PARM_DESC(shmem_cold_secs, "Seconds a shmem minor stays mapped after its last file is closed");
+
+#define FB536_LAT_BUCKETS 32
+
+/*
+ * Per-CPU counters shown in debugfs fb536/<minor>/stats. The histograms
+ * count nanosecond intervals by bit length: bucket b holds [2^(b-1), 2^b).
+ */
+struct fb536_stats {
+    u64 reads, read_bytes;
+    u64 writes, write_bytes[FB536_XOR + 1];
+    u64 ioctls[FB536_IOC_MAXNR + 1];
+    u64 notifies, notify_scanned;
+    u64 wakeups, wakeups_useful;
+    u64 lock_wait[FB536_LAT_BUCKETS];
+    u64 lock_hold[FB536_LAT_BUCKETS];
+    u64 wake_latency[FB536_LAT_BUCKETS];
+};
+
+/* Pending changes of one CPU's delta writers, see fb536_delta_write */
+struct fb536_delta_tile {
+    struct list_head node;
+    unsigned long tile;
+    unsigned char data[];       /* TILE_BYTES, the op's identity where unchanged */
+};
+
+struct fb536_delta {
+    struct mutex lock;
+    struct fb536_delta_tile **index;    /* by tile number, NULL if unchanged */
+    struct list_head tiles;
+    struct fb_viewport2 region; /* bounding box of the writes */
+};
 
 struct fb536_dev {
     unsigned char *data;
     unsigned long width;
     unsigned long height;
+    unsigned long bpp;
     unsigned long size;
+    u64 write_gen;
+    u64 *tile_gen;
+    unsigned long tiles_x, tiles_y;
+    struct list_head hist;      /* tile pre-images, oldest generation first */
+    unsigned long hist_depth;
+    unsigned long hist_versions;
+    unsigned long hist_bytes;
+    u64 hist_floor;             /* oldest generation that can be rebuilt */
+    u64 hist_skip;              /* generation whose pre-images were given up */
     struct mutex lock;
+    seqcount_mutex_t geo_seq;   /* width, height and bpp */
+    struct mutex resize_lock;
     struct cdev cdev;
     struct list_head file_list;
+    struct list_head groups;    /* struct fb536_wait_group */
+    u64 notify_seq;
+    int node;                   /* frame placement, see fb536_alloc_frame */
+    struct file *shmem;         /* backing file of the frame if shmem=1 */
+    struct page **shmem_pages;  /* its pages while dev->data maps them */
+    struct delayed_work cold_work;
+    u64 frame_gen;              /* replacements of the frame by resizes */
+    struct fb536_stats __percpu *stats;
+    u64 lock_t0;                /* when dev->lock was last taken */
+    struct dentry *debugfs;
+    int record;                 /* debugfs record: 0 off, 1 on, 2 with write hashes */
+    DECLARE_KFIFO_PTR(rec_fifo, struct fb536_rec);
+    spinlock_t rec_lock;        /* producers of rec_fifo */
+    struct mutex rec_read_lock; /* its consumer, and its allocation */
+    atomic64_t rec_files;
+    u64 rec_dropped;
+    struct percpu_rw_semaphore delta_sem;   /* delta writers share it, op changes and resizes take it alone */
+    struct fb536_delta __percpu *delta;
+    int delta_op;               /* op of all pending deltas */
+    int delta_pending;
+    struct work_struct delta_work;
+    struct kthread_worker *async_worker;
+    struct kthread_work async_work;
+    spinlock_t async_lock;      /* async_list and the async_queued and async_err of files */
+    struct list_head async_list;    /* struct fb536_async_write, in submission order */
+};
+
+/*
+ * Files that joined the same named group share one exclusive wait queue:
+ * a change intersecting any member's viewport counts one event and wakes
+ * one waiting member, which consumes it.
+ */
+struct fb536_wait_group {
+    struct list_head node;
+    char name[FB536_GROUP_NAME_LEN];
+    int refs;                   /* members and sleeping waiters */
+    wait_queue_head_t wq;
+    atomic_t events;
+    u64 last_seq;               /* notify_seq of the last counted event */
+    u64 wake_ns;                /* when events last became nonzero */
 };
 
 struct fb536_file_desc {
     struct fb536_dev *dev;
-    struct fb_viewport viewport;
+    struct fb_viewport2 viewport;
+    seqcount_mutex_t vp_seq;    /* viewport */
     int op;
     struct list_head node;
     wait_queue_head_t wq;
     int wake_flag;
+    u64 wake_ns;                /* when wake_flag was last set */
+    struct fb536_wait_group *group;
+    struct fasync_struct *async_queue;
+    struct eventfd_ctx *evfd;
+    u64 wake_min_ns;            /* wake at most once per interval, 0 = always */
+    u64 last_wake_ns;
+    struct hrtimer wake_timer;  /* deferred wake of a throttled file */
+    struct fb_viewport2 damage; /* changed part of the viewport, see FB536_IOCGETDAMAGE */
+    u64 delta_seen;     /* generation of the last complete delta pass */
+    u64 delta_upto;     /* generation the pass in progress will reach */
+    u32 delta_row;      /* next viewport tile row of that pass */
+    int delta_active;
+    struct mutex wc_lock;       /* write combining state below */
+    unsigned long wc_us;        /* flush deadline, 0 = combining off */
+    unsigned char *wc_buf;
+    size_t wc_cap, wc_len;
+    u64 wc_pos;                 /* viewport offset of wc_buf[0] */
+    struct delayed_work wc_work;
+    u64 rec_id;                 /* fb536_rec.file */
+    int delta;                  /* FB536_IOCTSETDELTA */
+    int async;                  /* FB536_IOCTSETASYNC */
+    size_t async_queued;        /* bytes */
+    int async_err;
+    wait_queue_head_t async_wq;
 };
 
 struct fb536_dev *fb536_devices;
+static struct dentry *fb536_debugfs;
 
-static int viewports_intersect(struct fb_viewport *a, struct fb_viewport *b) {
-    if (a->x >= b->x + b->width || b->x >= a->x + a->width) return 0;
-    if (a->y >= b->y + b->height || b->y >= a->y + a->height) return 0;
-    return 1;
+#define FB536_MINOR(d) MINOR((d)->cdev.dev)
+#define fb536_count(dev, field, n) this_cpu_add((dev)->stats->field, n)
+
+static void fb536_count_lat(u64 __percpu *hist, u64 ns) {
+    this_cpu_inc(hist[min(fls64(ns), FB536_LAT_BUCKETS - 1)]);
+}
+
+static void fb536_delta_merge(struct fb536_dev *dev);
+static void fb536_delta_drop(struct fb536_delta *d);
+
+/*
+ * dev->lock with wait and hold times recorded. Pending deltas are merged
+ * whenever it is taken, so its holders always see the whole frame.
+ */
+static void fb536_locked(struct fb536_dev *dev, u64 t0) {
+    u64 now = ktime_get_ns();
+    fb536_count_lat(dev->stats->lock_wait, now - t0);
+    trace_fb536_lock(FB536_MINOR(dev), now - t0);
+    dev->lock_t0 = now;
+    fb536_delta_merge(dev);
 }
 
-static void fb536_notify_waiters(struct fb536_dev *dev, struct fb_viewport *modified_region) {
+static void fb536_lock(struct fb536_dev *dev) {
+    u64 t0 = ktime_get_ns();
+    mutex_lock(&dev->lock);
+    fb536_locked(dev, t0);
+}
+
+static int fb536_lock_interruptible(struct fb536_dev *dev) {
+    u64 t0 = ktime_get_ns();
+    if (mutex_lock_interruptible(&dev->lock))
+        return -ERESTARTSYS;
+    fb536_locked(dev, t0);
+    return 0;
+}
+
+static void fb536_unlock(struct fb536_dev *dev) {
+    u64 held = ktime_get_ns() - dev->lock_t0;
+    mutex_unlock(&dev->lock);
+    fb536_count_lat(dev->stats->lock_hold, held);
+}
+
+static void fb536_count_write(struct fb536_file_desc *desc, size_t count) {
+    fb536_count(desc->dev, writes, 1);
+    fb536_count(desc->dev, write_bytes[desc->op], count);
+}
+
+static int fb536_recording(struct fb536_dev *dev) {
+    return unlikely(smp_load_acquire(&dev->record));
+}
+
+/* Append a trace record stamped with the call's entry time; the ring drops new records when full */
+static void fb536_record(struct fb536_file_desc *desc, u64 start_ns, u32 type, u32 cmd, u64 arg, u64 count,
+                         s64 ret, u32 hash, const void *argbuf, size_t arglen) {
+    struct fb536_dev *dev = desc->dev;
+    struct fb536_rec rec = {
+        .ts_ns = start_ns, .file = desc->rec_id, .type = type, .cmd = cmd,
+        .arg = arg, .count = count, .ret = ret, .hash = hash,
+    };
+
+    memcpy(rec.argbuf, argbuf, min(arglen, sizeof(rec.argbuf)));
+    spin_lock(&dev->rec_lock);
+    if (!kfifo_put(&dev->rec_fifo, rec))
+        dev->rec_dropped++;
+    spin_unlock(&dev->rec_lock);
+}
+
+/* crc32 of a user buffer, for record mode 2 */
+static u32 fb536_user_crc(const char __user *buf, size_t count) {
+    unsigned char tmp[256];
+    u32 crc = 0;
+
+    while (count) {
+        size_t n = min(count, sizeof(tmp));
+        if (copy_from_user(tmp, buf, n))
+            return 0;
+        crc = crc32_le(crc, tmp, n);
+        buf += n;
+        count -= n;
+    }
+    return crc;
+}
+
+/* Viewport check done first by every I/O function */
+static int viewport_usable(struct fb536_dev *dev, struct fb_viewport2 *vp) {
+    return fb536_vp_usable(vp, dev->width, dev->height);
+}
+
+/*
+ * desc's viewport and the frame geometry as of one instant, read without
+ * dev->lock. Writers change them under dev->lock, inside geo_seq or vp_seq.
+ */
+static void fb536_snapshot(struct fb536_file_desc *desc, struct fb_viewport2 *vp, struct fb_size2 *sz) {
+    struct fb536_dev *dev = desc->dev;
+    unsigned int gs, vs;
+
+    do {
+        gs = read_seqcount_begin(&dev->geo_seq);
+        vs = read_seqcount_begin(&desc->vp_seq);
+        *vp = desc->viewport;
+        sz->width = dev->width;
+        sz->height = dev->height;
+        sz->flags = 0;
+        sz->bpp = dev->bpp * 8;
+    } while (read_seqcount_retry(&desc->vp_seq, vs) || read_seqcount_retry(&dev->geo_seq, gs));
+}
+
+/*
+ * fb536_write_room (for a read, just the span) checked against a snapshot,
+ * so I/O past the end, through an unusable viewport or with a misaligned
+ * op fails without queueing on dev->lock. The locked path checks again.
+ */
+static ssize_t fb536_room_unlocked(struct fb536_file_desc *desc, u64 pos, size_t count, int write,
+                                   u64 *row_bytes) {
+    struct fb_viewport2 vp;
+    struct fb_size2 sz;
+    u32 bpp;
+
+    fb536_snapshot(desc, &vp, &sz);
+    bpp = sz.bpp / 8;
+    if (row_bytes)
+        *row_bytes = (u64)vp.width * bpp;
+    count = fb536_span(&vp, sz.width, sz.height, bpp, pos, count);
+    if (write && count && !fb536_op_aligned(bpp, READ_ONCE(desc->op), pos, count))
+        return -EINVAL;
+    return count;
+}
+
+/* SIGIO and eventfd notification for event loops that do not block in FB536_IOCWAIT */
+static void fb536_signal_async(struct fb536_file_desc *desc) {
+    struct eventfd_ctx *evfd = READ_ONCE(desc->evfd);
+
+    if (evfd)
+        eventfd_signal(evfd);
+    kill_fasync(&desc->async_queue, SIGIO, POLL_IN);
+}
+
+static void fb536_wake_now(struct fb536_file_desc *desc) {
+    if (!desc->wake_flag)
+        WRITE_ONCE(desc->wake_ns, ktime_get_ns());
+    fb536_count(desc->dev, wakeups, 1);
+    desc->wake_flag = 1;
+    wake_up_interruptible(&desc->wq);
+    fb536_signal_async(desc);
+}
+
+static enum hrtimer_restart fb536_wake_timer(struct hrtimer *timer) {
+    struct fb536_file_desc *desc = container_of(timer, struct fb536_file_desc, wake_timer);
+
+    WRITE_ONCE(desc->last_wake_ns, ktime_get_ns());
+    fb536_wake_now(desc);
+    return HRTIMER_NORESTART;
+}
+
+/*
+ * Wake desc for a change to region (NULL: everything). A file with a wake
+ * interval that was woken less than one interval ago gets a timer for the
+ * end of the interval instead; changes meanwhile only add to its damage.
+ */
+static void fb536_wake_desc(void *file, const struct fb_viewport2 *region) {
+    struct fb536_file_desc *desc = file;
+    struct fb536_wait_group *g = desc->group;
+    u64 next;
+
+    fb536_add_damage(&desc->viewport, &desc->damage, region);
+    if (g) {
+        trace_fb536_wake(FB536_MINOR(desc->dev), &desc->viewport, desc->dev->notify_seq, 2);
+        fb536_signal_async(desc);
+        /* One event per change however many members it intersects */
+        if (g->last_seq != desc->dev->notify_seq) {
+            g->last_seq = desc->dev->notify_seq;
+            if (atomic_inc_return(&g->events) == 1)
+                WRITE_ONCE(g->wake_ns, ktime_get_ns());
+            fb536_count(desc->dev, wakeups, 1);
+            wake_up_interruptible(&g->wq);
+        }
+        return;
+    }
+    if (desc->wake_min_ns &&
+        fb536_wake_throttled(&desc->last_wake_ns, desc->wake_min_ns, ktime_get_ns(), &next)) {
+        trace_fb536_wake(FB536_MINOR(desc->dev), &desc->viewport, desc->dev->notify_seq, 1);
+        if (!hrtimer_active(&desc->wake_timer))
+            hrtimer_start(&desc->wake_timer, ns_to_ktime(next), HRTIMER_MODE_ABS);
+        return;
+    }
+    trace_fb536_wake(FB536_MINOR(desc->dev), &desc->viewport, desc->dev->notify_seq, 0);
+    fb536_wake_now(desc);
+}
+
+static void fb536_notify_waiters(struct fb536_dev *dev, struct fb_viewport2 *modified_region) {
+    unsigned long scanned;
+    dev->notify_seq++;
+    scanned = fb536_notify_scan(&dev->file_list, offsetof(struct fb536_file_desc, node),
+                                offsetof(struct fb536_file_desc, viewport), modified_region,
+                                fb536_wake_desc);
+    fb536_count(dev, notifies, 1);
+    fb536_count(dev, notify_scanned, scanned);
+}
+
+/* Wake files whose viewport is not entirely within the preserved w x h region */
+static void fb536_notify_resized(struct fb536_dev *dev, unsigned long kept_w, unsigned long kept_h) {
     struct fb536_file_desc *desc;
+    dev->notify_seq++;
     list_for_each_entry(desc, &dev->file_list, node) {
-        if (modified_region == NULL || viewports_intersect(&desc->viewport, modified_region)) {
-            desc->wake_flag = 1;
-            wake_up_interruptible(&desc->wq);
+        if (!viewport_fits(&desc->viewport, kept_w, kept_h))
+            fb536_wake_desc(desc, NULL);
+    }
+}
+
+/*
+ * Byte histogram, eight bytes per load. Consecutive bytes go to different
+ * tables so increments of equal values do not serialize, and all-zero
+ * words, common in sparse frames, are counted without being split.
+ */
+static void fb536_histogram(const unsigned char *p, size_t n, u32 h[4][256]) {
+    size_t i = 0;
+    u64 w;
+
+    for (; i + 8 <= n; i += 8) {
+        memcpy(&w, p + i, 8);
+        if (!w) {
+            h[0][0] += 8;
+            continue;
+        }
+        h[0][w & 0xFF]++;
+        h[1][(w >> 8) & 0xFF]++;
+        h[2][(w >> 16) & 0xFF]++;
+        h[3][(w >> 24) & 0xFF]++;
+        h[0][(w >> 32) & 0xFF]++;
+        h[1][(w >> 40) & 0xFF]++;
+        h[2][(w >> 48) & 0xFF]++;
+        h[3][w >> 56]++;
+    }
+    for (; i < n; i++)
+        h[0][p[i]]++;
+}
+
+static void fb536_fold_histogram(struct fb_stats *st, u32 h[4][256]) {
+    int b;
+    for (b = 0; b < 256; b++)
+        st->hist[b] += (u64)h[0][b] + h[1][b] + h[2][b] + h[3][b];
+    memset(h, 0, 4 * 256 * sizeof(u32));
+}
+
+/* Fill st for the vp region; dev->lock is held */
+static void fb536_viewport_stats(struct fb536_dev *dev, struct fb_viewport2 *vp,
+                                 struct fb_stats *st, u32 h[4][256]) {
+    u64 row_bytes = (u64)vp->width * dev->bpp;
+    u64 stride = dev->width * dev->bpp;
+    unsigned char *p;
+    unsigned long r, pending = 0, fold_rows;
+    int b;
+
+    memset(st, 0, sizeof(*st));
+    memset(h, 0, 4 * 256 * sizeof(u32));
+    if (!viewport_usable(dev, vp) || !row_bytes)
+        return;
+
+    /* Fold before any 32-bit bin could overflow */
+    fold_rows = div64_u64(U32_MAX, row_bytes);
+    p = dev->data + vp->y * stride + (u64)vp->x * dev->bpp;
+    for (r = 0; r < vp->height; r++, p += stride) {
+        fb536_histogram(p, row_bytes, h);
+        if (++pending == fold_rows) {
+            fb536_fold_histogram(st, h);
+            pending = 0;
+        }
+    }
+    fb536_fold_histogram(st, h);
+
+    st->min = 255;
+    for (b = 0; b < 256; b++) {
+        if (!st->hist[b])
+            continue;
+        st->count += st->hist[b];
+        st->sum += st->hist[b] * b;
+        if (b < st->min) st->min = b;
+        st->max = b;
+    }
+    st->nonzero = st->count - st->hist[0];
+}
+
+#define TILES(n) (((n) + FB536_TILE_SIZE - 1) >> FB536_TILE_SHIFT)
+
+/*
+ * Frame history. Before a write first changes a tile, the tile's content
+ * is saved tagged with the write's generation. The frame as of generation
+ * g is then the current frame with each tile replaced by its oldest
+ * pre-image saved after g, if any. Whole generations are evicted, oldest
+ * first, beyond hist_depth versions or history_mb bytes.
+ */
+struct fb536_tile_copy {
+    struct list_head node;
+    u64 gen;
+    unsigned long tile;
+    unsigned char data[];       /* FB536_TILE_SIZE rows of FB536_TILE_SIZE pixels */
+};
+
+#define TILE_BYTES(dev) ((unsigned long)FB536_TILE_SIZE * FB536_TILE_SIZE * (dev)->bpp)
+
+static void fb536_hist_evict_oldest(struct fb536_dev *dev) {
+    struct fb536_tile_copy *tc, *tmp;
+    u64 gen = list_first_entry(&dev->hist, struct fb536_tile_copy, node)->gen;
+
+    list_for_each_entry_safe(tc, tmp, &dev->hist, node) {
+        if (tc->gen != gen)
+            break;
+        list_del(&tc->node);
+        dev->hist_bytes -= TILE_BYTES(dev);
+        kfree(tc);
+    }
+    dev->hist_versions--;
+    dev->hist_floor = gen;
+}
+
+/* Drop all history; nothing before the current generation can be rebuilt */
+static void fb536_hist_clear(struct fb536_dev *dev) {
+    while (!list_empty(&dev->hist))
+        fb536_hist_evict_oldest(dev);
+    dev->hist_floor = dev->write_gen;
+}
+
+static void fb536_hist_save(struct fb536_dev *dev, unsigned long tx, unsigned long ty) {
+    unsigned long row = FB536_TILE_SIZE * dev->bpp, x = tx << FB536_TILE_SHIFT, y, r;
+    unsigned long cols = min(dev->width - x, (unsigned long)FB536_TILE_SIZE) * dev->bpp;
+    struct fb536_tile_copy *tc, *last;
+
+    if (dev->hist_skip == dev->write_gen)
+        return;
+
+    tc = kmalloc(sizeof(*tc) + TILE_BYTES(dev), GFP_KERNEL);
+    if (!tc) {
+        fb536_hist_clear(dev);
+        dev->hist_skip = dev->write_gen;
+        return;
+    }
+    tc->gen = dev->write_gen;
+    tc->tile = ty * dev->tiles_x + tx;
+    for (r = 0, y = ty << FB536_TILE_SHIFT; r < FB536_TILE_SIZE && y < dev->height; r++, y++)
+        memcpy(tc->data + r * row, dev->data + (y * dev->width + x) * dev->bpp, cols);
+
+    last = list_empty(&dev->hist) ? NULL : list_last_entry(&dev->hist, struct fb536_tile_copy, node);
+    if (!last || last->gen != tc->gen)
+        dev->hist_versions++;
+    list_add_tail(&tc->node, &dev->hist);
+    dev->hist_bytes += TILE_BYTES(dev);
+
+    while (dev->hist_versions > dev->hist_depth || dev->hist_bytes > (history_mb << 20)) {
+        /* This generation alone does not fit */
+        if (list_first_entry(&dev->hist, struct fb536_tile_copy, node)->gen == dev->write_gen) {
+            fb536_hist_clear(dev);
+            dev->hist_skip = dev->write_gen;
+            break;
+        }
+        fb536_hist_evict_oldest(dev);
+    }
+}
+
+/* Stamp the tiles covering pixels [x0, x1] x [y0, y1] with the current generation */
+static void fb536_mark_tiles(struct fb536_dev *dev, unsigned long x0, unsigned long x1,
+                             unsigned long y0, unsigned long y1) {
+    unsigned long tx, ty;
+    for (ty = y0 >> FB536_TILE_SHIFT; ty <= y1 >> FB536_TILE_SHIFT; ty++)
+        for (tx = x0 >> FB536_TILE_SHIFT; tx <= x1 >> FB536_TILE_SHIFT; tx++) {
+            u64 *gen = &dev->tile_gen[ty * dev->tiles_x + tx];
+            if (dev->hist_depth && *gen != dev->write_gen)
+                fb536_hist_save(dev, tx, ty);
+            *gen = dev->write_gen;
+        }
+}
+
+/*
+ * Copy count bytes at viewport offset pos, as the frame was at generation
+ * gen, to buf. dev->lock is held and the range is within the viewport.
+ */
+static int fb536_hist_read(struct fb536_dev *dev, struct fb_viewport2 *vp, u64 gen,
+                           char __user *buf, size_t count, u64 pos) {
+    unsigned long tx0 = vp->x >> FB536_TILE_SHIFT, ty0 = vp->y >> FB536_TILE_SHIFT;
+    unsigned long ncols = ((vp->x + vp->width - 1) >> FB536_TILE_SHIFT) - tx0 + 1;
+    unsigned long nrows = ((vp->y + vp->height - 1) >> FB536_TILE_SHIFT) - ty0 + 1;
+    u64 row_bytes = (u64)vp->width * dev->bpp, vp_col;
+    unsigned char **src;
+    struct fb536_tile_copy *tc;
+    size_t done = 0;
+    int ret = 0;
+
+    src = kvcalloc(ncols * nrows, sizeof(*src), GFP_KERNEL);
+    if (!src)
+        return -ENOMEM;
+    list_for_each_entry(tc, &dev->hist, node) {
+        unsigned long tx = tc->tile % dev->tiles_x, ty = tc->tile / dev->tiles_x;
+        unsigned char **slot = &src[(ty - ty0) * ncols + (tx - tx0)];
+        if (tc->gen > gen && tx >= tx0 && tx < tx0 + ncols && ty >= ty0 && ty < ty0 + nrows && !*slot)
+            *slot = tc->data;
+    }
+
+    while (done < count) {
+        u64 y = vp->y + div64_u64_rem(pos, row_bytes, &vp_col);
+        u64 xb = (u64)vp->x * dev->bpp + vp_col;    /* byte column in the frame */
+        unsigned long x = div_u64(xb, dev->bpp);
+        unsigned long tile_end = ((x >> FB536_TILE_SHIFT) + 1) * FB536_TILE_SIZE * dev->bpp;
+        size_t chunk = min_t(u64, count - done, min_t(u64, row_bytes - vp_col, tile_end - xb));
+        unsigned char *tile = src[((y >> FB536_TILE_SHIFT) - ty0) * ncols + (x >> FB536_TILE_SHIFT) - tx0];
+        const unsigned char *from = tile ?
+            tile + (y & (FB536_TILE_SIZE - 1)) * FB536_TILE_SIZE * dev->bpp +
+                   (xb - (x & ~(FB536_TILE_SIZE - 1UL)) * dev->bpp) :
+            dev->data + y * dev->width * dev->bpp + xb;
+
+        if (copy_to_user(buf + done, from, chunk)) {
+            ret = -EFAULT;
+            break;
         }
+        done += chunk;
+        pos += chunk;
     }
+    kvfree(src);
+    return ret;
 }
 
+/*
+ * Emit the runs of one viewport tile row into out, setting *used. A span
+ * of changed tiles becomes one record per pixel row, or a single record
+ * when it covers the full viewport width so the rows are contiguous.
+ * Returns -ENOSPC, having written nothing, if the row needs more than len.
+ */
+static int fb536_delta_tile_row(struct fb536_dev *dev, struct fb_viewport2 *vp, u64 since,
+                                unsigned long ty, char __user *out, size_t len, size_t *used) {
+    unsigned long tx0 = vp->x >> FB536_TILE_SHIFT;
+    unsigned long tx1 = (vp->x + vp->width - 1) >> FB536_TILE_SHIFT;
+    unsigned long y0 = max_t(unsigned long, vp->y, ty << FB536_TILE_SHIFT);
+    unsigned long y1 = min_t(unsigned long, vp->y + vp->height, (ty + 1) << FB536_TILE_SHIFT);
+    u64 *gens = dev->tile_gen + ty * dev->tiles_x;
+    unsigned long tx, c0, x0, x1, y, step;
+    size_t need = 0;
+    int pass;
+    struct fb_delta_run run = { 0 };
+
+    *used = 0;
+    /* The first pass sizes the output, the second writes it */
+    for (pass = 0; pass < 2; pass++) {
+        for (tx = tx0; tx <= tx1; tx++) {
+            if (gens[tx] <= since)
+                continue;
+            for (c0 = tx; tx < tx1 && gens[tx + 1] > since; tx++)
+                ;
+            x0 = max_t(unsigned long, vp->x, c0 << FB536_TILE_SHIFT);
+            x1 = min_t(unsigned long, vp->x + vp->width, (tx + 1) << FB536_TILE_SHIFT);
+            /* Rows only follow each other in the frame if they are whole frame rows */
+            step = x1 - x0 == dev->width ? y1 - y0 : 1;
+            run.length = (x1 - x0) * dev->bpp * step;
+            for (y = y0; y < y1; y += step) {
+                if (!pass) {
+                    need += sizeof(run) + ALIGN(run.length, 8);
+                    continue;
+                }
+                run.offset = ((u64)(y - vp->y) * vp->width + (x0 - vp->x)) * dev->bpp;
+                if (copy_to_user(out + *used, &run, sizeof(run)) ||
+                    copy_to_user(out + *used + sizeof(run),
+                                 dev->data + (y * dev->width + x0) * dev->bpp, run.length))
+                    return -EFAULT;
+                *used += sizeof(run) + ALIGN(run.length, 8);
+            }
+        }
+        if (need > len)
+            return -ENOSPC;
+    }
+    return 0;
+}
+
+static int fb536_delta_read(struct fb536_file_desc *desc, struct fb_delta *d) {
+    struct fb536_dev *dev = desc->dev;
+    struct fb_viewport2 *vp = &desc->viewport;
+    char __user *out = u64_to_user_ptr(d->buf);
+    unsigned long ty0, ty1;
+    size_t n;
+    int ret;
+
+    if (d->flags & FB536_DELTA_FULL) {
+        desc->delta_seen = 0;
+        desc->delta_active = 0;
+    }
+    d->used = 0;
+    d->flags = 0;
+    d->gen = desc->delta_seen;
+    if (!desc->delta_active) {
+        desc->delta_upto = dev->write_gen;
+        desc->delta_row = 0;
+        desc->delta_active = 1;
+    }
+
+    if (viewport_usable(dev, vp) && vp->width && vp->height) {
+        ty0 = vp->y >> FB536_TILE_SHIFT;
+        ty1 = (vp->y + vp->height - 1) >> FB536_TILE_SHIFT;
+        for (; ty0 + desc->delta_row <= ty1; desc->delta_row++) {
+            ret = fb536_delta_tile_row(dev, vp, desc->delta_seen, ty0 + desc->delta_row,
+                                       out + d->used, d->len - d->used, &n);
+            if (ret == -ENOSPC && d->used) {
+                d->flags = FB536_DELTA_MORE;
+                return 0;
+            }
+            if (ret)
+                return ret;
+            d->used += n;
+        }
+    }
+
+    desc->delta_seen = desc->delta_upto;
+    desc->delta_active = 0;
+    d->gen = desc->delta_seen;
+    return 0;
+}
+
+static void fb536_copy_rows(unsigned char *dst, unsigned long dst_w,
+                            const unsigned char *src, unsigned long src_w,
+                            unsigned long cols, unsigned long rows) {
+    unsigned long r;
+    for (r = 0; r < rows; r++)
+        memcpy(dst + r * dst_w, src + r * src_w, cols);
+}
+
+struct fb536_frame {
+    unsigned char *data;
+    struct file *shmem;
+    struct page **pages;
+};
+
+static struct fb536_frame fb536_dev_frame(struct fb536_dev *dev) {
+    return (struct fb536_frame){ dev->data, dev->shmem, dev->shmem_pages };
+}
+
+/*
+ * Frame memory. With a node, pages come from that node; interleaved,
+ * page i comes from the i-th node with memory, round robin, and is mapped
+ * with vmap() so vfree() still releases it. Otherwise the allocating
+ * task's memory policy applies and huge pages are used where the
+ * architecture and free memory allow. This kernel exports no huge page
+ * vmalloc for a given node, so bound and interleaved frames use 4K pages.
+ */
+static void *fb536_alloc_pages(struct fb536_dev *dev, unsigned long size) {
+    unsigned long nr = DIV_ROUND_UP(size, PAGE_SIZE), i;
+    struct page **pages;
+    void *data;
+    int nid;
+
+    if (dev->node >= 0)
+        return vmalloc_node(size, dev->node);
+    if (dev->node != FB536_NODE_INTERLEAVE)
+        return hugepages ? vmalloc_huge(size, GFP_KERNEL) : vmalloc(size);
+
+    pages = kvmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return NULL;
+    nid = first_node(node_states[N_MEMORY]);
+    for (i = 0; i < nr; i++) {
+        pages[i] = alloc_pages_node(nid, GFP_KERNEL, 0);
+        if (!pages[i])
+            goto fail;
+        nid = next_node_in(nid, node_states[N_MEMORY]);
+    }
+    /* On success pages belongs to the mapping and is freed by vfree() */
+    data = vmap(pages, nr, VM_MAP | VM_MAP_PUT_PAGES, PAGE_KERNEL);
+    if (data)
+        return data;
+fail:
+    while (i--)
+        __free_page(pages[i]);
+    kvfree(pages);
+    return NULL;
+}
+
+/*
+ * A shmem frame is mapped with its pages pinned while the minor has open
+ * files, and for shmem_cold_secs after, so I/O works on dev->data as
+ * usual. Unmapped, its pages can be swapped like any other shmem.
+ */
+static int fb536_shmem_map(struct fb536_frame *f) {
+    unsigned long nr = DIV_ROUND_UP(i_size_read(file_inode(f->shmem)), PAGE_SIZE), i;
+    struct page **pages;
+
+    pages = kvmalloc_array(nr, sizeof(*pages), GFP_KERNEL);
+    if (!pages)
+        return -ENOMEM;
+    for (i = 0; i < nr; i++) {
+        pages[i] = shmem_read_mapping_page(f->shmem->f_mapping, i);
+        if (IS_ERR(pages[i]))
+            goto fail;
+    }
+    f->data = vmap(pages, nr, VM_MAP, PAGE_KERNEL);
+    if (f->data) {
+        f->pages = pages;
+        return 0;
+    }
+fail:
+    while (i--)
+        put_page(pages[i]);
+    kvfree(pages);
+    return -ENOMEM;
+}
+
+static void fb536_shmem_unmap(struct fb536_frame *f) {
+    unsigned long nr = DIV_ROUND_UP(i_size_read(file_inode(f->shmem)), PAGE_SIZE), i;
+
+    vunmap(f->data);
+    for (i = 0; i < nr; i++) {
+        set_page_dirty(f->pages[i]);
+        mark_page_accessed(f->pages[i]);
+        put_page(f->pages[i]);
+    }
+    kvfree(f->pages);
+    f->data = NULL;
+    f->pages = NULL;
+}
+
+/* Unmap the frame of a minor that stayed without open files */
+static void fb536_cold_work(struct work_struct *work) {
+    struct fb536_dev *dev = container_of(to_delayed_work(work), struct fb536_dev, cold_work);
+
+    fb536_lock(dev);
+    if (list_empty(&dev->file_list) && dev->data) {
+        struct fb536_frame f = fb536_dev_frame(dev);
+        fb536_shmem_unmap(&f);
+        dev->data = NULL;
+        dev->shmem_pages = NULL;
+    }
+    fb536_unlock(dev);
+}
+
+/* Map the frame back if fb536_cold_work unmapped it; dev->lock is held */
+static int fb536_warm(struct fb536_dev *dev) {
+    struct fb536_frame f;
+
+    if (!dev->shmem || dev->data)
+        return 0;
+    f = fb536_dev_frame(dev);
+    if (fb536_shmem_map(&f))
+        return -ENOMEM;
+    dev->data = f.data;
+    dev->shmem_pages = f.pages;
+    return 0;
+}
+
+/* Shmem frames are placed by shmem, not by node and hugepages */
+static int fb536_alloc_frame(struct fb536_dev *dev, unsigned long size, struct fb536_frame *f) {
+    memset(f, 0, sizeof(*f));
+    if (shmem) {
+        f->shmem = shmem_file_setup("fb536", size, VM_NORESERVE);
+        if (IS_ERR(f->shmem) || fb536_shmem_map(f)) {
+            if (!IS_ERR(f->shmem))
+                fput(f->shmem);
+            f->shmem = NULL;
+            return -ENOMEM;
+        }
+        return 0;
+    }
+    f->data = fb536_alloc_pages(dev, size);
+    return f->data ? 0 : -ENOMEM;
+}
+
+static void fb536_free_frame(struct fb536_frame *f) {
+    if (!f->shmem) {
+        vfree(f->data);
+        return;
+    }
+    if (f->data)
+        fb536_shmem_unmap(f);
+    fput(f->shmem);
+}
+
+/*
+ * Replace the frame with a new_w x new_h one of new_bpp bytes per pixel
+ * (0 keeps the current format). With keep set, the top-left region both
+ * geometries share is carried over; it is copied without dev->lock and
+ * only recopied under it if a write raced with the copy. resize_lock keeps
+ * dev->data alive while it is read unlocked.
+ */
+static int fb536_resize(struct fb536_dev *dev, unsigned long new_w, unsigned long new_h,
+                        unsigned long new_bpp, int keep) {
+    struct fb536_frame new_frame, old_frame;
+    unsigned char *new_data, *old_data;
+    u64 *new_tiles, *old_tiles, gen;
+    unsigned long old_w, old_h, cols = 0, rows = 0, r, new_size, bpp, tx, ty;
+    int cpu;
+
+    if (mutex_lock_interruptible(&dev->resize_lock))
+        return -ERESTARTSYS;
+
+    bpp = new_bpp ? new_bpp : dev->bpp;
+    if ((keep && bpp != dev->bpp) ||
+        check_mul_overflow(new_w, new_h, &new_size) ||
+        check_mul_overflow(new_size, bpp, &new_size) ||
+        new_size > (maxframe_mb << 20)) {
+        mutex_unlock(&dev->resize_lock);
+        return -EINVAL;
+    }
+
+    if (fb536_alloc_frame(dev, new_size, &new_frame)) {
+        mutex_unlock(&dev->resize_lock);
+        return -ENOMEM;
+    }
+    new_data = new_frame.data;
+    new_tiles = kvcalloc(TILES(new_w) * TILES(new_h), sizeof(u64), GFP_KERNEL);
+    if (!new_tiles) {
+        fb536_free_frame(&new_frame);
+        mutex_unlock(&dev->resize_lock);
+        return -ENOMEM;
+    }
+
+    fb536_lock(dev);
+    old_data = dev->data;
+    old_w = dev->width;
+    old_h = dev->height;
+    gen = dev->write_gen;
+    fb536_unlock(dev);
+
+    if (keep) {
+        cols = min(old_w, new_w);
+        rows = min(old_h, new_h);
+    }
+
+    fb536_copy_rows(new_data, new_w * bpp, old_data, old_w * bpp, cols * bpp, rows);
+    for (r = 0; r < rows; r++)
+        memset(new_data + (r * new_w + cols) * bpp, 0, (new_w - cols) * bpp);
+    memset(new_data + rows * new_w * bpp, 0, (new_h - rows) * new_w * bpp);
+
+    /* Merges the deltas written meanwhile and keeps new ones out */
+    percpu_down_write(&dev->delta_sem);
+    fb536_lock(dev);
+    if (keep && dev->write_gen != gen)
+        fb536_copy_rows(new_data, new_w * bpp, dev->data, old_w * bpp, cols * bpp, rows);
+    dev->write_gen++;
+    /* A tile keeps its generation only if all of it that remains was kept */
+    for (ty = 0; ty < TILES(new_h); ty++)
+        for (tx = 0; tx < TILES(new_w); tx++)
+            new_tiles[ty * TILES(new_w) + tx] =
+                min((tx + 1) << FB536_TILE_SHIFT, new_w) <= cols &&
+                min((ty + 1) << FB536_TILE_SHIFT, new_h) <= rows ?
+                dev->tile_gen[ty * dev->tiles_x + tx] : dev->write_gen;
+    old_tiles = dev->tile_gen;
+    dev->tile_gen = new_tiles;
+    dev->tiles_x = TILES(new_w);
+    dev->tiles_y = TILES(new_h);
+    old_frame = fb536_dev_frame(dev);
+    dev->data = new_data;
+    dev->frame_gen++;
+    dev->shmem = new_frame.shmem;
+    dev->shmem_pages = new_frame.pages;
+    write_seqcount_begin(&dev->geo_seq);
+    dev->width = new_w;
+    dev->height = new_h;
+    dev->bpp = bpp;
+    write_seqcount_end(&dev->geo_seq);
+    dev->size = new_size;
+    fb536_hist_clear(dev);
+    for_each_possible_cpu(cpu)
+        fb536_delta_drop(per_cpu_ptr(dev->delta, cpu));
+    if (keep)
+        fb536_notify_resized(dev, cols, rows);
+    else
+        fb536_notify_waiters(dev, NULL);
+    fb536_unlock(dev);
+    percpu_up_write(&dev->delta_sem);
+
+    mutex_unlock(&dev->resize_lock);
+    fb536_free_frame(&old_frame);
+    kvfree(old_tiles);
+    return 0;
+}
+
+/*
+ * dma-buf export. The buffer takes a reference on each page of its range,
+ * so it outlives resizes and cold unmaps; once a resize replaced the frame
+ * it is detached and CPU access no longer touches the device. dev->lock
+ * is not held between begin and end CPU access, which may span syscalls:
+ * begin merges pending deltas, and end after a write stamps the frame
+ * rows the buffer's pages overlap, its span, with a new generation and
+ * notifies their waiters. The writes happened in
+ * place, so the history cannot rebuild anything before that generation.
+ */
+struct fb536_dmabuf {
+    struct fb536_dev *dev;
+    u64 frame_gen;
+    struct fb_viewport2 span;   /* whole frame rows the pages overlap */
+    int write;
+    struct page **pages;
+    unsigned long nr;
+    struct mutex lock;          /* attachments */
+    struct list_head attachments;
+};
+
+struct fb536_dmabuf_attach {
+    struct list_head node;
+    struct device *dev;
+    struct sg_table sgt;
+    enum dma_data_direction dir;    /* DMA_NONE while unmapped */
+};
+
+static int fb536_dmabuf_attach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+    struct fb536_dmabuf_attach *a;
+    int ret;
+
+    a = kzalloc(sizeof(*a), GFP_KERNEL);
+    if (!a)
+        return -ENOMEM;
+    ret = sg_alloc_table_from_pages(&a->sgt, b->pages, b->nr, 0, b->nr << PAGE_SHIFT, GFP_KERNEL);
+    if (ret) {
+        kfree(a);
+        return ret;
+    }
+    a->dev = attach->dev;
+    a->dir = DMA_NONE;
+    attach->priv = a;
+    mutex_lock(&b->lock);
+    list_add(&a->node, &b->attachments);
+    mutex_unlock(&b->lock);
+    return 0;
+}
+
+static void fb536_dmabuf_detach(struct dma_buf *dmabuf, struct dma_buf_attachment *attach) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+    struct fb536_dmabuf_attach *a = attach->priv;
+
+    mutex_lock(&b->lock);
+    list_del(&a->node);
+    mutex_unlock(&b->lock);
+    sg_free_table(&a->sgt);
+    kfree(a);
+}
+
+static struct sg_table *fb536_dmabuf_map(struct dma_buf_attachment *attach, enum dma_data_direction dir) {
+    struct fb536_dmabuf *b = attach->dmabuf->priv;
+    struct fb536_dmabuf_attach *a = attach->priv;
+    int ret;
+
+    ret = dma_map_sgtable(a->dev, &a->sgt, dir, 0);
+    if (ret)
+        return ERR_PTR(ret);
+    mutex_lock(&b->lock);
+    a->dir = dir;
+    mutex_unlock(&b->lock);
+    return &a->sgt;
+}
+
+static void fb536_dmabuf_unmap(struct dma_buf_attachment *attach, struct sg_table *sgt,
+                               enum dma_data_direction dir) {
+    struct fb536_dmabuf *b = attach->dmabuf->priv;
+    struct fb536_dmabuf_attach *a = attach->priv;
+
+    mutex_lock(&b->lock);
+    a->dir = DMA_NONE;
+    mutex_unlock(&b->lock);
+    dma_unmap_sgtable(a->dev, sgt, dir, 0);
+}
+
+/*
+ * Lock dev if b still exports its frame, mapping a cold frame back for the
+ * duration of shmem_cold_secs; returns 0 if it does not
+ */
+static int fb536_dmabuf_lock(struct fb536_dmabuf *b) {
+    struct fb536_dev *dev = b->dev;
+
+    fb536_lock(dev);
+    if (dev->frame_gen != b->frame_gen) {
+        fb536_unlock(dev);
+        return 0;
+    }
+    if (!dev->data) {
+        if (fb536_warm(dev)) {
+            fb536_unlock(dev);
+            return -ENOMEM;
+        }
+        if (list_empty(&dev->file_list))
+            mod_delayed_work(system_wq, &dev->cold_work, shmem_cold_secs * HZ);
+    }
+    return 1;
+}
+
+static void fb536_dmabuf_mark(struct fb536_dmabuf *b) {
+    struct fb536_dev *dev = b->dev;
+
+    dev->write_gen++;
+    if (dev->hist_depth) {
+        fb536_hist_clear(dev);
+        dev->hist_skip = dev->write_gen;
+    }
+    fb536_mark_tiles(dev, 0, b->span.width - 1, b->span.y, b->span.y + b->span.height - 1);
+}
+
+static int fb536_dmabuf_begin_cpu(struct dma_buf *dmabuf, enum dma_data_direction dir) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+    struct fb536_dmabuf_attach *a;
+    int ret;
+
+    mutex_lock(&b->lock);
+    list_for_each_entry(a, &b->attachments, node)
+        if (a->dir != DMA_NONE)
+            dma_sync_sgtable_for_cpu(a->dev, &a->sgt, a->dir);
+    mutex_unlock(&b->lock);
+
+    /* Taking dev->lock merges pending deltas */
+    ret = fb536_dmabuf_lock(b);
+    if (ret > 0)
+        fb536_unlock(b->dev);
+    return min(ret, 0);
+}
+
+static int fb536_dmabuf_end_cpu(struct dma_buf *dmabuf, enum dma_data_direction dir) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+    struct fb536_dmabuf_attach *a;
+    int ret = 0;
+
+    if (b->write && dir != DMA_FROM_DEVICE)
+        ret = fb536_dmabuf_lock(b);
+    if (ret > 0) {
+        fb536_dmabuf_mark(b);
+        fb536_notify_waiters(b->dev, &b->span);
+        fb536_unlock(b->dev);
+    }
+
+    mutex_lock(&b->lock);
+    list_for_each_entry(a, &b->attachments, node)
+        if (a->dir != DMA_NONE)
+            dma_sync_sgtable_for_device(a->dev, &a->sgt, a->dir);
+    mutex_unlock(&b->lock);
+    return min(ret, 0);
+}
+
+static int fb536_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+
+    return vm_map_pages(vma, b->pages, b->nr);
+}
+
+static int fb536_dmabuf_vmap(struct dma_buf *dmabuf, struct iosys_map *map) {
+    struct fb536_dmabuf *b = dmabuf->priv;
+    void *vaddr = vmap(b->pages, b->nr, VM_MAP, PAGE_KERNEL);
+
+    if (!vaddr)
+        return -ENOMEM;
+    iosys_map_set_vaddr(map, vaddr);
+    return 0;
+}
+
+static void fb536_dmabuf_vunmap(struct dma_buf *dmabuf, struct iosys_map *map) {
+    vunmap(map->vaddr);
+}
+
+static void fb536_dmabuf_free(struct fb536_dmabuf *b) {
+    unsigned long i;
+
+    for (i = 0; i < b->nr; i++)
+        put_page(b->pages[i]);
+    kvfree(b->pages);
+    kfree(b);
+}
+
+static void fb536_dmabuf_release(struct dma_buf *dmabuf) {
+    fb536_dmabuf_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops fb536_dmabuf_ops = {
+    .attach = fb536_dmabuf_attach,
+    .detach = fb536_dmabuf_detach,
+    .map_dma_buf = fb536_dmabuf_map,
+    .unmap_dma_buf = fb536_dmabuf_unmap,
+    .begin_cpu_access = fb536_dmabuf_begin_cpu,
+    .end_cpu_access = fb536_dmabuf_end_cpu,
+    .mmap = fb536_dmabuf_mmap,
+    .vmap = fb536_dmabuf_vmap,
+    .vunmap = fb536_dmabuf_vunmap,
+    .release = fb536_dmabuf_release,
+};
+
+static int fb536_export_dmabuf(struct fb536_file_desc *desc, struct fb_dmabuf *req) {
+    DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+    struct fb536_dev *dev = desc->dev;
+    struct fb_viewport2 region = req->region;
+    struct fb536_dmabuf *b;
+    struct dma_buf *dmabuf;
+    u64 start, end, stride, first;
+    unsigned long i;
+    int fd;
+
+    b = kzalloc(sizeof(*b), GFP_KERNEL);
+    if (!b)
+        return -ENOMEM;
+    mutex_init(&b->lock);
+    INIT_LIST_HEAD(&b->attachments);
+    b->dev = dev;
+    b->write = !!(req->flags & FB536_DMABUF_WRITE);
+
+    fb536_lock(dev);
+    if (!region.width || !region.height)
+        region = (struct fb_viewport2){ 0, 0, dev->width, dev->height };
+    if (!viewport_usable(dev, &region)) {
+        fb536_unlock(dev);
+        kfree(b);
+        return -EINVAL;
+    }
+    stride = dev->width * dev->bpp;
+    start = region.y * stride + (u64)region.x * dev->bpp;
+    end = (region.y + region.height - 1) * stride + ((u64)region.x + region.width) * dev->bpp;
+    first = start >> PAGE_SHIFT;
+    b->nr = DIV_ROUND_UP(end, PAGE_SIZE) - first;
+    b->span.y = div64_u64(first << PAGE_SHIFT, stride);
+    b->span.width = dev->width;
+    b->span.height = min_t(u64, dev->height, div64_u64(((first + b->nr) << PAGE_SHIFT) + stride - 1, stride))
+                     - b->span.y;
+    b->pages = kvmalloc_array(b->nr, sizeof(*b->pages), GFP_KERNEL);
+    if (!b->pages) {
+        fb536_unlock(dev);
+        kfree(b);
+        return -ENOMEM;
+    }
+    for (i = 0; i < b->nr; i++) {
+        b->pages[i] = vmalloc_to_page(dev->data + ((first + i) << PAGE_SHIFT));
+        get_page(b->pages[i]);
+    }
+    b->frame_gen = dev->frame_gen;
+    fb536_unlock(dev);
+
+    exp_info.ops = &fb536_dmabuf_ops;
+    exp_info.size = b->nr << PAGE_SHIFT;
+    exp_info.flags = b->write ? O_RDWR : O_RDONLY;
+    exp_info.priv = b;
+    dmabuf = dma_buf_export(&exp_info);
+    if (IS_ERR(dmabuf)) {
+        fb536_dmabuf_free(b);
+        return PTR_ERR(dmabuf);
+    }
+    fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+    if (fd < 0) {
+        dma_buf_put(dmabuf);
+        return fd;
+    }
+    req->fd = fd;
+    req->offset = start & ~PAGE_MASK;
+    req->stride = stride;
+    req->size = exp_info.size;
+    return 0;
+}
+
+/* Drop a reference to g; dev->lock is held */
+static void fb536_group_put(struct fb536_dev *dev, struct fb536_wait_group *g) {
+    if (--g->refs)
+        return;
+    list_del(&g->node);
+    kfree(g);
+}
+
+/* Move desc to the group called name, or out of any group if name is empty */
+static int fb536_join_group(struct fb536_file_desc *desc, const char *name) {
+    struct fb536_dev *dev = desc->dev;
+    struct fb536_wait_group *g, *fresh = NULL;
+
+    if (name[0]) {
+        fresh = kzalloc(sizeof(*fresh), GFP_KERNEL);
+        if (!fresh)
+            return -ENOMEM;
+        strscpy(fresh->name, name, sizeof(fresh->name));
+        init_waitqueue_head(&fresh->wq);
+        atomic_set(&fresh->events, 0);
+    }
+
+    fb536_lock(dev);
+    if (desc->group)
+        fb536_group_put(dev, desc->group);
+    desc->group = NULL;
+    if (fresh) {
+        list_for_each_entry(g, &dev->groups, node) {
+            if (!strncmp(g->name, fresh->name, sizeof(g->name))) {
+                desc->group = g;
+                break;
+            }
+        }
+        if (!desc->group) {
+            list_add(&fresh->node, &dev->groups);
+            desc->group = fresh;
+            fresh = NULL;
+        }
+        desc->group->refs++;
+    }
+    fb536_unlock(dev);
+    kfree(fresh);
+    return 0;
+}
+
+static void fb536_wc_flush(struct fb536_file_desc *desc);
+static void fb536_wc_sync(struct fb536_file_desc *desc);
+static size_t fb536_async_queued(struct fb536_file_desc *desc);
+static int fb536_async_wait(struct fb536_file_desc *desc);
+static void fb536_wc_work(struct work_struct *work);
+static ssize_t fb536_do_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+
 static int fb536_open(struct inode *inode, struct file *filp) {
     struct fb536_dev *dev;
     struct fb536_file_desc *desc;
@@ -78,199 +1333,817 @@ static int fb536_open(struct inode *inode, struct file *filp) {
     desc = kzalloc(sizeof(struct fb536_file_desc), GFP_KERNEL);
     if (!desc) return -ENOMEM;
 
-    mutex_lock(&dev->lock);
+    seqcount_mutex_init(&desc->vp_seq, &dev->lock);
+    fb536_lock(dev);
+    if (fb536_warm(dev)) {
+        fb536_unlock(dev);
+        kfree(desc);
+        return -ENOMEM;
+    }
     desc->dev = dev;
     desc->viewport.x = 0;
     desc->viewport.y = 0;
-    desc->viewport.width = (unsigned short)dev->width;
-    desc->viewport.height = (unsigned short)dev->height;
+    desc->viewport.width = dev->width;
+    desc->viewport.height = dev->height;
     desc->op = FB536_SET;
     init_waitqueue_head(&desc->wq);
+    init_waitqueue_head(&desc->async_wq);
     desc->wake_flag = 0;
+    mutex_init(&desc->wc_lock);
+    INIT_DELAYED_WORK(&desc->wc_work, fb536_wc_work);
+    hrtimer_init(&desc->wake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    desc->wake_timer.function = fb536_wake_timer;
+
+    list_add(&desc->node, &dev->file_list);
+    fb536_unlock(dev);
+
+    desc->rec_id = atomic64_inc_return(&dev->rec_files);
+    filp->private_data = desc;
+    if (fb536_recording(dev))
+        fb536_record(desc, ktime_get_ns(), FB536_REC_OPEN, 0, filp->f_flags, 0, 0, 0, NULL, 0);
+    return 0;
+}
+
+static int fb536_release(struct inode *inode, struct file *filp) {
+    struct fb536_file_desc *desc = filp->private_data;
+    struct fb536_dev *dev = desc->dev;
+
+    cancel_delayed_work_sync(&desc->wc_work);
+    fb536_wc_flush(desc);
+    /* The async worker holds no reference once the queue is empty */
+    wait_event(desc->async_wq, !fb536_async_queued(desc));
+
+    fb536_lock(dev);
+    list_del(&desc->node);
+    if (desc->group)
+        fb536_group_put(dev, desc->group);
+    if (dev->shmem && list_empty(&dev->file_list))
+        mod_delayed_work(system_wq, &dev->cold_work, shmem_cold_secs * HZ);
+    fb536_unlock(dev);
+    hrtimer_cancel(&desc->wake_timer);
+    if (desc->evfd)
+        eventfd_ctx_put(desc->evfd);
+    if (fb536_recording(dev))
+        fb536_record(desc, ktime_get_ns(), FB536_REC_RELEASE, 0, 0, 0, 0, 0, NULL, 0);
+
+    kvfree(desc->wc_buf);
+    kfree(desc);
+    return 0;
+}
+
+static int fb536_fasync(int fd, struct file *filp, int mode) {
+    struct fb536_file_desc *desc = filp->private_data;
+    return fasync_helper(fd, filp, mode, &desc->async_queue);
+}
+
+/* Signal the eventfd fd on changes to the viewport; -1 unbinds */
+static int fb536_bind_eventfd(struct fb536_file_desc *desc, int fd) {
+    struct fb536_dev *dev = desc->dev;
+    struct eventfd_ctx *ctx = NULL, *old;
+
+    if (fd != -1) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    fb536_lock(dev);
+    old = desc->evfd;
+    WRITE_ONCE(desc->evfd, ctx);
+    fb536_unlock(dev);
+
+    if (old) {
+        /* The wake timer reads desc->evfd without dev->lock; deliver a wake it still had pending */
+        if (hrtimer_cancel(&desc->wake_timer))
+            fb536_wake_timer(&desc->wake_timer);
+        eventfd_ctx_put(old);
+    }
+    return 0;
+}
+
+static ssize_t fb536_do_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+    struct fb536_file_desc *desc = filp->private_data;
+    struct fb536_dev *dev = desc->dev;
+    ssize_t retval;
+
+    if (READ_ONCE(desc->wc_len))
+        fb536_wc_sync(desc);
+    if (READ_ONCE(desc->async_queued) && fb536_async_wait(desc))
+        return -ERESTARTSYS;
+    if (!fb536_room_unlocked(desc, *f_pos, count, 0, NULL))
+        return 0;
+
+    if (fb536_lock_interruptible(dev))
+        return -ERESTARTSYS;
+
+    count = fb536_span(&desc->viewport, dev->width, dev->height, dev->bpp, *f_pos, count);
+    retval = fb536_read_span(buf, dev->data, &desc->viewport, dev->width, dev->bpp, count, *f_pos);
+    if (!retval) {
+        retval = count;
+        *f_pos += count;
+    }
+    fb536_unlock(dev);
+    if (retval > 0) {
+        fb536_count(dev, reads, 1);
+        fb536_count(dev, read_bytes, retval);
+    }
+    return retval;
+}
+
+/*
+ * Bytes a write of count at pos may apply to desc's viewport: 0 at end of
+ * file or for an unusable viewport, -EINVAL for partial RGB565 pixels
+ * with a saturating op. dev->lock is held.
+ */
+static ssize_t fb536_write_room(struct fb536_file_desc *desc, u64 pos, size_t count) {
+    struct fb536_dev *dev = desc->dev;
+
+    count = fb536_span(&desc->viewport, dev->width, dev->height, dev->bpp, pos, count);
+    if (count && !fb536_op_aligned(dev->bpp, desc->op, pos, count))
+        return -EINVAL;
+    return count;
+}
+
+/* Apply src at viewport offset pos with desc's op, row by row; dev->lock is held */
+static void fb536_mark_row(void *dev, u64 x0, u64 x1, u64 y, u64 off, size_t n) {
+    fb536_mark_tiles(dev, x0, x1, y, y);
+}
+
+static void fb536_apply(struct fb536_file_desc *desc, const unsigned char *src, size_t count, u64 pos) {
+    struct fb536_dev *dev = desc->dev;
+
+    fb536_apply_span(dev->data, &desc->viewport, dev->width, dev->bpp, fb536_ops[dev->bpp >> 1][desc->op],
+                     src, count, pos, fb536_mark_row, dev);
+}
+
+/* Wake waiters on the viewport rows bytes [pos, pos + count) touched */
+static void fb536_notify_span(struct fb536_file_desc *desc, u64 pos, size_t count) {
+    struct fb_viewport2 write_region;
+
+    fb536_span_region(&desc->viewport, desc->dev->bpp, pos, count, &write_region);
+    fb536_notify_waiters(desc->dev, &write_region);
+}
+
+/* Bytes of user data staged per copy; even, so 16bpp ADD and SUB stay aligned */
+#define FB536_WRITE_CHUNK PAGE_SIZE
+
+static ssize_t fb536_write_direct(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+    struct fb536_file_desc *desc = filp->private_data;
+    struct fb536_dev *dev = desc->dev;
+    ssize_t retval = 0;
+    unsigned char *kbuf;
+    size_t done = 0;
+
+    retval = fb536_room_unlocked(desc, *f_pos, count, 1, NULL);
+    if (retval <= 0)
+        return retval;
+    kbuf = kmalloc(FB536_WRITE_CHUNK, GFP_KERNEL);
+    if (!kbuf)
+        return -ENOMEM;
+    if (fb536_lock_interruptible(dev)) {
+        kfree(kbuf);
+        return -ERESTARTSYS;
+    }
+
+    retval = fb536_write_room(desc, *f_pos, count);
+    if (retval <= 0)
+        goto out;
+    count = retval;
+
+    while (done < count) {
+        size_t n = min_t(size_t, count - done, FB536_WRITE_CHUNK);
+
+        if (copy_from_user(kbuf, buf + done, n))
+            break;
+        if (!done)
+            dev->write_gen++;
+        fb536_apply(desc, kbuf, n, *f_pos + done);
+        done += n;
+    }
+
+    if (done) {
+        fb536_count_write(desc, done);
+        fb536_notify_span(desc, *f_pos, done);
+        *f_pos += done;
+    }
+    retval = done ? done : -EFAULT;
+out:
+    fb536_unlock(dev);
+    kfree(kbuf);
+    return retval;
+}
+
+/*
+ * Delta writes. XOR, OR and AND writes of files in delta mode combine
+ * into tiles of the current CPU's fb536_delta under that CPU's lock only,
+ * so writers of hot shared regions do not serialize on dev->lock. Only
+ * equal ops commute: all pending deltas share dev->delta_op, and a write
+ * with another op first merges them with delta_sem held alone. Taking
+ * dev->lock merges, and delta_work takes it soon after the writes to
+ * wake their waiters.
+ */
+static int fb536_commutes(int op) {
+    return op == FB536_XOR || op == FB536_OR || op == FB536_AND;
+}
+
+static void fb536_delta_drop(struct fb536_delta *d) {
+    struct fb536_delta_tile *t, *tmp;
+
+    list_for_each_entry_safe(t, tmp, &d->tiles, node)
+        kfree(t);
+    INIT_LIST_HEAD(&d->tiles);
+    kvfree(d->index);
+    d->index = NULL;
+    memset(&d->region, 0, sizeof(d->region));
+}
+
+/* Apply and drop the pending deltas of every CPU; dev->lock is held */
+static void fb536_delta_merge(struct fb536_dev *dev) {
+    struct fb_viewport2 frame = { 0, 0, dev->width, dev->height }, region = { 0, 0, 0, 0 };
+    fb536_op_fn apply = fb536_ops[dev->bpp >> 1][dev->delta_op];
+    u64 stride = dev->width * dev->bpp;
+    int cpu, merged = 0;
+
+    if (!READ_ONCE(dev->delta_pending))
+        return;
+    WRITE_ONCE(dev->delta_pending, 0);
+    /* A writer that finds delta_pending still set has its tiles merged below */
+    smp_mb();
+
+    for_each_possible_cpu(cpu) {
+        struct fb536_delta *d = per_cpu_ptr(dev->delta, cpu);
+        struct fb536_delta_tile *t, *tmp;
+
+        mutex_lock(&d->lock);
+        list_for_each_entry_safe(t, tmp, &d->tiles, node) {
+            unsigned long x0 = (t->tile % dev->tiles_x) << FB536_TILE_SHIFT;
+            unsigned long y0 = (t->tile / dev->tiles_x) << FB536_TILE_SHIFT;
+            unsigned long cols = min(dev->width - x0, (unsigned long)FB536_TILE_SIZE);
+            unsigned long rows = min(dev->height - y0, (unsigned long)FB536_TILE_SIZE), r;
+
+            if (!merged++)
+                dev->write_gen++;
+            fb536_mark_tiles(dev, x0, x0 + cols - 1, y0, y0 + rows - 1);
+            for (r = 0; r < rows; r++)
+                apply(dev->data + (y0 + r) * stride + x0 * dev->bpp,
+                      t->data + r * FB536_TILE_SIZE * dev->bpp, cols * dev->bpp);
+            d->index[t->tile] = NULL;
+            list_del(&t->node);
+            kfree(t);
+        }
+        fb536_add_damage(&frame, &region, &d->region);
+        memset(&d->region, 0, sizeof(d->region));
+        mutex_unlock(&d->lock);
+    }
+    if (merged)
+        fb536_notify_waiters(dev, &region);
+}
+
+static void fb536_delta_sync(struct fb536_dev *dev) {
+    if (READ_ONCE(dev->delta_pending)) {
+        fb536_lock(dev);
+        fb536_unlock(dev);
+    }
+}
+
+static void fb536_delta_work(struct work_struct *work) {
+    fb536_delta_sync(container_of(work, struct fb536_dev, delta_work));
+}
+
+static int fb536_delta_init(struct fb536_dev *dev) {
+    int cpu;
+
+    if (percpu_init_rwsem(&dev->delta_sem))
+        return -ENOMEM;
+    dev->delta = alloc_percpu(struct fb536_delta);
+    if (!dev->delta)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        struct fb536_delta *d = per_cpu_ptr(dev->delta, cpu);
+        mutex_init(&d->lock);
+        INIT_LIST_HEAD(&d->tiles);
+    }
+    dev->delta_op = FB536_XOR;
+    INIT_WORK(&dev->delta_work, fb536_delta_work);
+    return 0;
+}
+
+static void fb536_delta_free(struct fb536_dev *dev) {
+    int cpu;
+
+    if (dev->delta)
+        for_each_possible_cpu(cpu)
+            fb536_delta_drop(per_cpu_ptr(dev->delta, cpu));
+    free_percpu(dev->delta);
+    percpu_free_rwsem(&dev->delta_sem);
+}
+
+/* d's delta tile number tile, started at the identity of dev->delta_op */
+static struct fb536_delta_tile *fb536_delta_tile(struct fb536_dev *dev, struct fb536_delta *d,
+                                                 unsigned long tile) {
+    struct fb536_delta_tile *t = d->index[tile];
+
+    if (t)
+        return t;
+    t = kmalloc(struct_size(t, data, TILE_BYTES(dev)), GFP_KERNEL);
+    if (!t)
+        return NULL;
+    t->tile = tile;
+    memset(t->data, dev->delta_op == FB536_AND ? 0xFF : 0, TILE_BYTES(dev));
+    list_add_tail(&t->node, &d->tiles);
+    d->index[tile] = t;
+    return t;
+}
+
+static ssize_t fb536_delta_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos,
+                                 int op) {
+    struct fb536_file_desc *desc = filp->private_data;
+    struct fb536_dev *dev = desc->dev;
+    u64 tile_bytes, row_bytes, vp_col;
+    struct fb_viewport2 vp, frame, region;
+    struct fb_size2 sz;
+    struct fb536_delta *d;
+    fb536_op_fn apply;
+    unsigned char *kbuf;
+    ssize_t retval;
+    size_t done = 0;
+
+    if (READ_ONCE(desc->wc_len))
+        fb536_wc_sync(desc);
+
+    percpu_down_read(&dev->delta_sem);
+    while (dev->delta_op != op) {
+        percpu_up_read(&dev->delta_sem);
+        percpu_down_write(&dev->delta_sem);
+        fb536_lock(dev);
+        dev->delta_op = op;
+        fb536_unlock(dev);
+        percpu_up_write(&dev->delta_sem);
+        percpu_down_read(&dev->delta_sem);
+    }
+
+    /* The geometry cannot change while delta_sem is held */
+    fb536_snapshot(desc, &vp, &sz);
+    tile_bytes = (u64)FB536_TILE_SIZE * dev->bpp;
+    row_bytes = (u64)vp.width * dev->bpp;
+    count = fb536_span(&vp, dev->width, dev->height, dev->bpp, *f_pos, count);
+    retval = count;
+    if (!count)
+        goto out;
+
+    kbuf = kvmalloc(count, GFP_KERNEL);
+    if (!kbuf) {
+        retval = -ENOMEM;
+        goto out;
+    }
+    if (copy_from_user(kbuf, buf, count)) {
+        retval = -EFAULT;
+        goto out_free;
+    }
 
-    list_add(&desc->node, &dev->file_list);
-    mutex_unlock(&dev->lock);
+    apply = fb536_ops[dev->bpp >> 1][op];
+    d = raw_cpu_ptr(dev->delta);
+    mutex_lock(&d->lock);
+    if (!d->index)
+        d->index = kvcalloc(dev->tiles_x * dev->tiles_y, sizeof(*d->index), GFP_KERNEL);
+    while (d->index && done < count) {
+        u64 y = vp.y + div64_u64_rem(*f_pos + done, row_bytes, &vp_col);
+        u64 xb = (u64)vp.x * dev->bpp + vp_col;     /* byte column in the frame */
+        u64 tx = div64_u64(xb, tile_bytes);
+        size_t n = min_t(u64, count - done, min(row_bytes - vp_col, (tx + 1) * tile_bytes - xb));
+        struct fb536_delta_tile *t = fb536_delta_tile(dev, d, (y >> FB536_TILE_SHIFT) * dev->tiles_x + tx);
+
+        if (!t)
+            break;
+        apply(t->data + (y & (FB536_TILE_SIZE - 1)) * tile_bytes + (xb - tx * tile_bytes), kbuf + done, n);
+        done += n;
+    }
+    if (done) {
+        frame = (struct fb_viewport2){ 0, 0, dev->width, dev->height };
+        fb536_span_region(&vp, dev->bpp, *f_pos, done, &region);
+        fb536_add_damage(&frame, &d->region, &region);
+    }
+    mutex_unlock(&d->lock);
+    retval = done ? done : -ENOMEM;
+    if (done && !READ_ONCE(dev->delta_pending))
+        WRITE_ONCE(dev->delta_pending, 1);
 
-    filp->private_data = desc;
-    return 0;
+out_free:
+    kvfree(kbuf);
+out:
+    percpu_up_read(&dev->delta_sem);
+    if (retval > 0) {
+        if (!work_pending(&dev->delta_work))
+            schedule_work(&dev->delta_work);
+        fb536_count_write(desc, retval);
+        *f_pos += retval;
+    }
+    return retval;
 }
 
-static int fb536_release(struct inode *inode, struct file *filp) {
-    struct fb536_file_desc *desc = filp->private_data;
+/*
+ * Write combining. Small writes are copied into a per-file buffer holding
+ * at most one viewport row and applied together, with one notification,
+ * when the row ends, a write is not contiguous, the op or viewport changes,
+ * the file is read, flushed or synced, or the deadline passes.
+ */
+static void fb536_wc_flush(struct fb536_file_desc *desc) {
     struct fb536_dev *dev = desc->dev;
+    ssize_t n;
+
+    if (!desc->wc_len)
+        return;
+    fb536_lock(dev);
+    /* Dropped if the viewport became unusable meanwhile */
+    n = fb536_write_room(desc, desc->wc_pos, desc->wc_len);
+    if (n > 0) {
+        dev->write_gen++;
+        fb536_apply(desc, desc->wc_buf, n, desc->wc_pos);
+        fb536_count_write(desc, n);
+        fb536_notify_span(desc, desc->wc_pos, n);
+    }
+    fb536_unlock(dev);
+    desc->wc_len = 0;
+}
 
-    mutex_lock(&dev->lock);
-    list_del(&desc->node);
-    mutex_unlock(&dev->lock);
+static void fb536_wc_sync(struct fb536_file_desc *desc) {
+    mutex_lock(&desc->wc_lock);
+    fb536_wc_flush(desc);
+    mutex_unlock(&desc->wc_lock);
+}
 
-    kfree(desc);
-    return 0;
+static void fb536_wc_work(struct work_struct *work) {
+    struct fb536_file_desc *desc = container_of(to_delayed_work(work), struct fb536_file_desc, wc_work);
+    fb536_wc_sync(desc);
 }
 
-static ssize_t fb536_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+static ssize_t fb536_wc_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
     struct fb536_file_desc *desc = filp->private_data;
-    struct fb536_dev *dev = desc->dev;
-    ssize_t retval = 0;
-    unsigned long vp_size;
+    u64 row_bytes, vp_col;
+    ssize_t retval;
+    size_t chunk;
 
-    if (mutex_lock_interruptible(&dev->lock))
-        return -ERESTARTSYS;
+    mutex_lock(&desc->wc_lock);
+    if (*f_pos != desc->wc_pos + desc->wc_len)
+        fb536_wc_flush(desc);
 
-    if (desc->viewport.x >= dev->width ||
-        desc->viewport.y >= dev->height ||
-        desc->viewport.x + desc->viewport.width > dev->width ||
-        desc->viewport.y + desc->viewport.height > dev->height) {
-        retval = 0;
+    /* Early check only, fb536_wc_flush repeats it under dev->lock */
+    retval = fb536_room_unlocked(desc, *f_pos, count, 1, &row_bytes);
+    if (retval <= 0)
         goto out;
+    count = retval;
+
+    div64_u64_rem(*f_pos, row_bytes, &vp_col);
+    if (count >= row_bytes - vp_col && !desc->wc_len) {
+        /* Reaches the end of the row: nothing to combine with */
+        mutex_unlock(&desc->wc_lock);
+        return fb536_write_direct(filp, buf, count, f_pos);
     }
 
-    vp_size = (unsigned long)desc->viewport.width * (unsigned long)desc->viewport.height;
+    if (desc->wc_cap < row_bytes) {
+        unsigned char *nbuf = kvmalloc(row_bytes, GFP_KERNEL);
+        if (!nbuf) {
+            retval = -ENOMEM;
+            goto out;
+        }
+        memcpy(nbuf, desc->wc_buf, desc->wc_len);
+        kvfree(desc->wc_buf);
+        desc->wc_buf = nbuf;
+        desc->wc_cap = row_bytes;
+    }
+    if (!desc->wc_len)
+        desc->wc_pos = *f_pos;
 
-    if (*f_pos >= vp_size) {
-        retval = 0;
+    chunk = min_t(u64, count, row_bytes - vp_col);
+    if (copy_from_user(desc->wc_buf + desc->wc_len, buf, chunk)) {
+        retval = -EFAULT;
         goto out;
     }
-    if (*f_pos + count > vp_size)
-        count = vp_size - *f_pos;
-
-    while (count > 0) {
-        unsigned long current_vp_pos = (unsigned long)*f_pos;
-        unsigned long vp_row = current_vp_pos / desc->viewport.width;
-        unsigned long vp_col = current_vp_pos % desc->viewport.width;
+    desc->wc_len += chunk;
+    *f_pos += chunk;
+    retval = chunk;
+
+    if (chunk == row_bytes - vp_col)
+        fb536_wc_flush(desc);
+    else
+        schedule_delayed_work(&desc->wc_work, usecs_to_jiffies(desc->wc_us));
+    mutex_unlock(&desc->wc_lock);
+
+    /* The rest starts a new row and is combined or written on its own merits */
+    if (count > chunk) {
+        ssize_t rest = fb536_do_write(filp, buf + chunk, count - chunk, f_pos);
+        if (rest > 0)
+            retval += rest;
+    }
+    return retval;
+out:
+    mutex_unlock(&desc->wc_lock);
+    return retval;
+}
 
-        unsigned long bytes_in_row = desc->viewport.width - vp_col;
-        unsigned long chunk = (count < bytes_in_row) ? count : bytes_in_row;
+/*
+ * Asynchronous writes. Writes of a file in async mode are checked against
+ * a snapshot, copied and queued on the minor's list, and the minor's
+ * kthread worker applies everything queued under one hold of dev->lock.
+ * Changes made through the file and reads from it wait for its queue
+ * first, so they stay in order with its writes.
+ */
+struct fb536_async_write {
+    struct list_head node;
+    struct fb536_file_desc *desc;
+    u64 pos;
+    size_t count;
+    ssize_t ret;
+    unsigned char data[];
+};
 
-        unsigned long global_row = desc->viewport.y + vp_row;
-        unsigned long global_col = desc->viewport.x + vp_col;
+static size_t fb536_async_queued(struct fb536_file_desc *desc) {
+    size_t queued;
 
-        if (global_row >= dev->height) break;
-        if (global_col + chunk > dev->width) chunk = dev->width - global_col;
+    spin_lock(&desc->dev->async_lock);
+    queued = desc->async_queued;
+    spin_unlock(&desc->dev->async_lock);
+    return queued;
+}
 
-        unsigned long global_off = global_row * dev->width + global_col;
+/* A write larger than async_queue_kb waits for an empty queue */
+static int fb536_async_fits(size_t queued, size_t n) {
+    return !queued || queued + n <= (size_t)async_queue_kb << 10;
+}
 
-        if (copy_to_user(buf + retval, dev->data + global_off, chunk)) {
-            retval = -EFAULT;
-            goto out;
+static void fb536_async_work(struct kthread_work *work) {
+    struct fb536_dev *dev = container_of(work, struct fb536_dev, async_work);
+    struct fb536_async_write *w, *tmp;
+    LIST_HEAD(batch);
+
+    spin_lock(&dev->async_lock);
+    list_splice_init(&dev->async_list, &batch);
+    spin_unlock(&dev->async_lock);
+    if (list_empty(&batch))
+        return;
+
+    fb536_lock(dev);
+    list_for_each_entry(w, &batch, node) {
+        ssize_t n = fb536_write_room(w->desc, w->pos, w->count);
+        if (n > 0) {
+            dev->write_gen++;
+            fb536_apply(w->desc, w->data, n, w->pos);
+            fb536_count_write(w->desc, n);
+            fb536_notify_span(w->desc, w->pos, n);
         }
-
-        retval += chunk;
-        *f_pos += chunk;
-        count -= chunk;
+        /* Clipped or dropped if the frame shrank since the write was checked */
+        w->ret = n == w->count ? 0 : n < 0 ? n : -ENOSPC;
+    }
+    fb536_unlock(dev);
+
+    list_for_each_entry_safe(w, tmp, &batch, node) {
+        struct fb536_file_desc *desc = w->desc;
+
+        /* desc may be freed once its queue is seen empty, after this unlock */
+        spin_lock(&dev->async_lock);
+        if (w->ret && !desc->async_err)
+            desc->async_err = w->ret;
+        desc->async_queued -= w->count;
+        wake_up_interruptible_all(&desc->async_wq);
+        spin_unlock(&dev->async_lock);
+        kvfree(w);
     }
-
-out:
-    mutex_unlock(&dev->lock);
-    return retval;
 }
 
-static ssize_t fb536_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+static ssize_t fb536_async_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
     struct fb536_file_desc *desc = filp->private_data;
     struct fb536_dev *dev = desc->dev;
-    ssize_t retval = 0;
-    unsigned long vp_size;
-    unsigned char *kbuf;
-    int i;
-    struct fb_viewport write_region;
+    struct fb536_async_write *w;
+    ssize_t n;
+
+    if (READ_ONCE(desc->wc_len))
+        fb536_wc_sync(desc);
+    n = fb536_room_unlocked(desc, *f_pos, count, 1, NULL);
+    if (n <= 0)
+        return n;
+
+    w = kvmalloc(struct_size(w, data, n), GFP_KERNEL);
+    if (!w)
+        return -ENOMEM;
+    if (copy_from_user(w->data, buf, n)) {
+        kvfree(w);
+        return -EFAULT;
+    }
+    w->desc = desc;
+    w->pos = *f_pos;
+    w->count = n;
+
+    spin_lock(&dev->async_lock);
+    while (!fb536_async_fits(desc->async_queued, n)) {
+        spin_unlock(&dev->async_lock);
+        if (wait_event_interruptible(desc->async_wq, fb536_async_fits(fb536_async_queued(desc), n))) {
+            kvfree(w);
+            return -ERESTARTSYS;
+        }
+        spin_lock(&dev->async_lock);
+    }
+    desc->async_queued += n;
+    list_add_tail(&w->node, &dev->async_list);
+    spin_unlock(&dev->async_lock);
 
-    if (mutex_lock_interruptible(&dev->lock))
+    kthread_queue_work(dev->async_worker, &dev->async_work);
+    *f_pos += n;
+    return n;
+}
+
+/* Wait until desc's queued writes are applied */
+static int fb536_async_wait(struct fb536_file_desc *desc) {
+    if (wait_event_interruptible(desc->async_wq, !fb536_async_queued(desc)))
         return -ERESTARTSYS;
+    return 0;
+}
 
-    if (desc->viewport.x >= dev->width ||
-        desc->viewport.y >= dev->height ||
-        desc->viewport.x + desc->viewport.width > dev->width ||
-        desc->viewport.y + desc->viewport.height > dev->height) {
-        retval = 0;
-        goto out;
-    }
+/* fb536_async_wait, then the first error of a queued write since the last call */
+static int fb536_async_flush(struct fb536_file_desc *desc) {
+    int err = fb536_async_wait(desc);
 
-    vp_size = (unsigned long)desc->viewport.width * (unsigned long)desc->viewport.height;
-    if (*f_pos >= vp_size) {
-        retval = 0;
-        goto out;
-    }
-    if (*f_pos + count > vp_size)
-        count = vp_size - *f_pos;
+    if (err)
+        return err;
+    spin_lock(&desc->dev->async_lock);
+    err = desc->async_err;
+    desc->async_err = 0;
+    spin_unlock(&desc->dev->async_lock);
+    return err;
+}
 
-    kbuf = kmalloc(count, GFP_KERNEL);
-    if (!kbuf) {
-        retval = -ENOMEM;
-        goto out;
+/* Commands that change what later writes through the file do */
+static int fb536_async_ordered(unsigned int cmd) {
+    switch (cmd) {
+    case FB536_IOCRESET:
+    case FB536_IOCTSETSIZE:
+    case FB536_IOCTRESIZE:
+    case FB536_IOCSETSIZE2:
+    case FB536_IOCSETVIEWPORT:
+    case FB536_IOCSETVIEWPORT2:
+    case FB536_IOCTSETOP:
+    case FB536_IOCWRITERLE:
+    case FB536_IOCTSETWC:
+    case FB536_IOCTSETDELTA:
+    case FB536_IOCTSETASYNC:
+        return 1;
+    default:
+        return 0;
     }
+}
 
-    if (copy_from_user(kbuf, buf, count)) {
-        kfree(kbuf);
-        retval = -EFAULT;
-        goto out;
-    }
+/* Always readable, as without a poll method; writable once the async queue drained */
+static __poll_t fb536_poll(struct file *filp, poll_table *wait) {
+    struct fb536_file_desc *desc = filp->private_data;
+    __poll_t mask = EPOLLIN | EPOLLRDNORM;
 
-    unsigned long start_vp_pos = (unsigned long)*f_pos;
-    unsigned long end_vp_pos = start_vp_pos + count - 1;
-    unsigned long start_row = start_vp_pos / desc->viewport.width;
-    unsigned long end_row = end_vp_pos / desc->viewport.width;
+    poll_wait(filp, &desc->async_wq, wait);
+    if (!fb536_async_queued(desc))
+        mask |= EPOLLOUT | EPOLLWRNORM;
+    return mask;
+}
 
-    write_region.x = desc->viewport.x;
-    write_region.width = desc->viewport.width;
-    write_region.y = desc->viewport.y + start_row;
-    write_region.height = end_row - start_row + 1;
+static ssize_t fb536_do_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+    struct fb536_file_desc *desc = filp->private_data;
+    int op = READ_ONCE(desc->op);
+
+    if (READ_ONCE(desc->async))
+        return fb536_async_write(filp, buf, count, f_pos);
+    if (READ_ONCE(desc->delta) && fb536_commutes(op))
+        return fb536_delta_write(filp, buf, count, f_pos, op);
+    if (READ_ONCE(desc->wc_us))
+        return fb536_wc_write(filp, buf, count, f_pos);
+    return fb536_write_direct(filp, buf, count, f_pos);
+}
 
-    for (i = 0; i < count; i++) {
-        unsigned char val = kbuf[i];
-        unsigned long current_vp_pos = start_vp_pos + i;
-        unsigned long vp_row = current_vp_pos / desc->viewport.width;
-        unsigned long vp_col = current_vp_pos % desc->viewport.width;
-        unsigned long global_row = desc->viewport.y + vp_row;
-        unsigned long global_col = desc->viewport.x + vp_col;
+static ssize_t fb536_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos) {
+    struct fb536_file_desc *desc = filp->private_data;
+    loff_t pos = *f_pos;
+    u64 t0 = 0;
+    ssize_t retval;
+
+    trace_fb536_read_enter(FB536_MINOR(desc->dev), &desc->viewport, desc->op, *f_pos, count);
+    if (trace_fb536_read_exit_enabled() || fb536_recording(desc->dev))
+        t0 = ktime_get_ns();
+    retval = fb536_do_read(filp, buf, count, f_pos);
+    trace_fb536_read_exit(FB536_MINOR(desc->dev), retval, t0 ? ktime_get_ns() - t0 : 0);
+    if (t0 && fb536_recording(desc->dev))
+        fb536_record(desc, t0, FB536_REC_READ, 0, pos, count, retval, 0, NULL, 0);
+    return retval;
+}
 
-        if (global_row >= dev->height) continue;
-        if (global_col >= dev->width) continue;
+static ssize_t fb536_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
+    struct fb536_file_desc *desc = filp->private_data;
+    loff_t pos = *f_pos;
+    u64 t0 = 0;
+    ssize_t retval;
+
+    trace_fb536_write_enter(FB536_MINOR(desc->dev), &desc->viewport, desc->op, *f_pos, count);
+    if (trace_fb536_write_exit_enabled() || fb536_recording(desc->dev))
+        t0 = ktime_get_ns();
+    retval = fb536_do_write(filp, buf, count, f_pos);
+    trace_fb536_write_exit(FB536_MINOR(desc->dev), retval, t0 ? ktime_get_ns() - t0 : 0);
+    if (t0 && fb536_recording(desc->dev))
+        fb536_record(desc, t0, FB536_REC_WRITE, 0, pos, count, retval,
+                     READ_ONCE(desc->dev->record) == 2 ? fb536_user_crc(buf, count) : 0, NULL, 0);
+    return retval;
+}
 
-        unsigned long global_off = global_row * dev->width + global_col;
+static int fb536_flush(struct file *filp, fl_owner_t id) {
+    struct fb536_file_desc *desc = filp->private_data;
+    fb536_wc_sync(desc);
+    fb536_delta_sync(desc->dev);
+    /* Queued async writes are waited for in fb536_release */
+    return 0;
+}
 
-        switch (desc->op) {
-            case FB536_SET:
-                dev->data[global_off] = val;
-                break;
-            case FB536_ADD:
-                if ((int)dev->data[global_off] + val > 255) dev->data[global_off] = 255;
-                else dev->data[global_off] += val;
-                break;
-            case FB536_SUB:
-                if ((int)dev->data[global_off] - val < 0) dev->data[global_off] = 0;
-                else dev->data[global_off] -= val;
-                break;
-            case FB536_AND:
-                dev->data[global_off] &= val;
-                break;
-            case FB536_OR:
-                dev->data[global_off] |= val;
-                break;
-            case FB536_XOR:
-                dev->data[global_off] ^= val;
-                break;
-        }
+static int fb536_fsync(struct file *filp, loff_t start, loff_t end, int datasync) {
+    struct fb536_file_desc *desc = filp->private_data;
+    fb536_wc_sync(desc);
+    fb536_delta_sync(desc->dev);
+    return fb536_async_flush(desc);
+}
+
+static void fb536_rle_emit(void *desc, const unsigned char *src, size_t n, u64 pos) {
+    fb536_apply(desc, src, n, pos);
+}
+
+static long fb536_write_rle(struct file *filp, struct fb_rle_write __user *arg) {
+    struct fb536_file_desc *desc = filp->private_data;
+    struct fb536_dev *dev = desc->dev;
+    struct fb_rle_write r;
+    struct fb_viewport2 vp;
+    struct fb_size2 sz;
+    unsigned char *in, *scratch;
+    long total, count;
+    u64 max;
+    int cut = 0;
+
+    if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
+    if (copy_from_user(&r, arg, sizeof(r))) return -EFAULT;
+    if (r.len > INT_MAX) return -EINVAL;
+
+    /*
+     * Past this the stream decodes to more than the viewport holds, and
+     * the rest would be clipped anyway, so it is not worth staging.
+     */
+    fb536_snapshot(desc, &vp, &sz);
+    max = FB536_RLE_MAX((u64)vp.width * vp.height, sz.bpp / 8);
+    if (r.len > max) {
+        r.len = max;
+        cut = 1;
     }
 
-    retval = count;
-    *f_pos += count;
+    in = kvmalloc(r.len, GFP_KERNEL);
+    scratch = kmalloc(FB536_RLE_CHUNK, GFP_KERNEL);
+    if (!in || !scratch) {
+        count = -ENOMEM;
+        goto out_free;
+    }
+    if (copy_from_user(in, u64_to_user_ptr(r.buf), r.len)) {
+        count = -EFAULT;
+        goto out_free;
+    }
 
-    fb536_notify_waiters(dev, &write_region);
+    if (fb536_lock_interruptible(dev)) {
+        count = -ERESTARTSYS;
+        goto out_free;
+    }
+    if (cut)
+        r.len = fb536_rle_whole(in, r.len, dev->bpp);
+    total = fb536_rle_length(in, r.len, dev->bpp);
+    count = total < 0 ? total : fb536_write_room(desc, filp->f_pos, total);
+    if (count > 0) {
+        dev->write_gen++;
+        fb536_rle_apply(in, count, dev->bpp, filp->f_pos, scratch, fb536_rle_emit, desc);
+        fb536_count_write(desc, count);
+        fb536_notify_span(desc, filp->f_pos, count);
+        filp->f_pos += count;
+    }
+    fb536_unlock(dev);
 
-    kfree(kbuf);
-out:
-    mutex_unlock(&dev->lock);
-    return retval;
+out_free:
+    kfree(scratch);
+    kvfree(in);
+    return count;
 }
 
-static loff_t fb536_llseek(struct file *filp, loff_t off, int whence) {
+static loff_t fb536_do_llseek(struct file *filp, loff_t off, int whence) {
     struct fb536_file_desc *desc = filp->private_data;
-    unsigned long vp_size = (unsigned long)desc->viewport.width * (unsigned long)desc->viewport.height;
-    loff_t newpos;
+    struct fb_viewport2 vp;
+    struct fb_size2 sz;
+    loff_t vp_size, newpos;
+
+    fb536_snapshot(desc, &vp, &sz);
+    vp_size = (u64)vp.width * vp.height * (sz.bpp / 8);
 
     switch(whence) {
         case SEEK_SET: newpos = off; break;
-        case SEEK_CUR: newpos = filp->f_pos + off; break;
-        case SEEK_END: newpos = vp_size + off; break;
+        case SEEK_CUR:
+            if (check_add_overflow(filp->f_pos, off, &newpos)) return -EINVAL;
+            break;
+        case SEEK_END:
+            if (check_add_overflow(vp_size, off, &newpos)) return -EINVAL;
+            break;
         default: return -EINVAL;
     }
     if (newpos < 0) return -EINVAL;
@@ -278,96 +2151,399 @@ static loff_t fb536_llseek(struct file *filp, loff_t off, int whence) {
     return newpos;
 }
 
-static long fb536_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+static long fb536_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
     struct fb536_file_desc *desc = filp->private_data;
     struct fb536_dev *dev = desc->dev;
     int retval = 0;
 
+    if (_IOC_TYPE(cmd) == FB536_IOC_MAGIC && _IOC_NR(cmd) <= FB536_IOC_MAXNR)
+        fb536_count(dev, ioctls[_IOC_NR(cmd)], 1);
+    if (fb536_async_ordered(cmd) && READ_ONCE(desc->async_queued) && fb536_async_wait(desc))
+        return -ERESTARTSYS;
+
     switch(cmd) {
         case FB536_IOCRESET:
-            mutex_lock(&dev->lock);
+            fb536_lock(dev);
+            dev->write_gen++;
+            fb536_mark_tiles(dev, 0, dev->width - 1, 0, dev->height - 1);
             memset(dev->data, 0, dev->size);
             fb536_notify_waiters(dev, NULL);
-            mutex_unlock(&dev->lock);
+            fb536_unlock(dev);
             break;
 
-        case FB536_IOCTSETSIZE: {
+        case FB536_IOCTSETSIZE:
+        case FB536_IOCTRESIZE: {
             int new_w = arg >> 16;
             int new_h = arg & 0xFFFF;
-            unsigned char *new_data;
-            if (new_w <= 255 || new_w > 10000 || new_h <= 255 || new_h > 10000) return -EINVAL;
-
-            new_data = vmalloc(new_w * new_h);
-            if (!new_data) return -ENOMEM;
-            memset(new_data, 0, new_w * new_h);
-
-            mutex_lock(&dev->lock);
-            vfree(dev->data);
-            dev->data = new_data;
-            dev->width = new_w;
-            dev->height = new_h;
-            dev->size = new_w * new_h;
-            fb536_notify_waiters(dev, NULL);
-            mutex_unlock(&dev->lock);
+            if (new_w < FB536_MIN_DIM || new_w > FB536_MAX_DIM || new_h < FB536_MIN_DIM || new_h > FB536_MAX_DIM)
+                return -EINVAL;
+
+            retval = fb536_resize(dev, new_w, new_h, 0, cmd == FB536_IOCTRESIZE);
+            break;
+        }
+
+        case FB536_IOCSETSIZE2: {
+            struct fb_size2 sz;
+            if (copy_from_user(&sz, (void __user *)arg, sizeof(sz))) return -EFAULT;
+            if (sz.width < FB536_MIN_DIM || sz.width > FB536_MAX_DIM2 ||
+                sz.height < FB536_MIN_DIM || sz.height > FB536_MAX_DIM2 ||
+                (sz.flags & ~FB536_SIZE_KEEP) ||
+                (sz.bpp != 0 && sz.bpp != FB536_BPP_8 && sz.bpp != FB536_BPP_16 && sz.bpp != FB536_BPP_32))
+                return -EINVAL;
+
+            retval = fb536_resize(dev, sz.width, sz.height, sz.bpp / 8, sz.flags & FB536_SIZE_KEEP);
             break;
         }
 
-        case FB536_IOCQGETSIZE:
-            mutex_lock(&dev->lock);
-            retval = (dev->width << 16) | (dev->height & 0xFFFF);
-            mutex_unlock(&dev->lock);
+        case FB536_IOCQGETSIZE: {
+            struct fb_viewport2 vp;
+            struct fb_size2 sz;
+            fb536_snapshot(desc, &vp, &sz);
+            /* The packed value is returned as a positive int */
+            if (sz.width > 0x7FFF || sz.height > 0xFFFF)
+                retval = -EOVERFLOW;
+            else
+                retval = (sz.width << 16) | (sz.height & 0xFFFF);
             break;
+        }
+
+        case FB536_IOCGETSIZE2: {
+            struct fb_viewport2 vp;
+            struct fb_size2 sz;
+            fb536_snapshot(desc, &vp, &sz);
+            if (copy_to_user((void __user *)arg, &sz, sizeof(sz)))
+                retval = -EFAULT;
+            break;
+        }
 
-        case FB536_IOCSETVIEWPORT: {
-            struct fb_viewport tmp;
-            if (copy_from_user(&tmp, (void __user *)arg, sizeof(tmp))) return -EFAULT;
+        case FB536_IOCSETVIEWPORT:
+        case FB536_IOCSETVIEWPORT2: {
+            struct fb_viewport2 tmp;
+            if (cmd == FB536_IOCSETVIEWPORT) {
+                struct fb_viewport old;
+                if (copy_from_user(&old, (void __user *)arg, sizeof(old))) return -EFAULT;
+                tmp.x = old.x;
+                tmp.y = old.y;
+                tmp.width = old.width;
+                tmp.height = old.height;
+            } else if (copy_from_user(&tmp, (void __user *)arg, sizeof(tmp))) {
+                return -EFAULT;
+            }
+            fb536_wc_sync(desc);
 
-            mutex_lock(&dev->lock);
-            if (tmp.x + tmp.width > dev->width || tmp.y + tmp.height > dev->height) {
-                mutex_unlock(&dev->lock);
+            fb536_lock(dev);
+            if (!viewport_fits(&tmp, dev->width, dev->height)) {
+                fb536_unlock(dev);
                 return -EINVAL;
             }
+            write_seqcount_begin(&desc->vp_seq);
             desc->viewport = tmp;
+            write_seqcount_end(&desc->vp_seq);
+            memset(&desc->damage, 0, sizeof(desc->damage));
+            desc->delta_seen = 0;
+            desc->delta_active = 0;
             desc->wake_flag = 1;
             wake_up_interruptible(&desc->wq);
+            if (desc->group)
+                wake_up_interruptible_all(&desc->group->wq);
+
+            fb536_unlock(dev);
+            break;
+        }
+
+        case FB536_IOCGETVIEWPORT: {
+            struct fb_viewport old;
+            struct fb_viewport2 vp;
+            struct fb_size2 sz;
+            fb536_snapshot(desc, &vp, &sz);
+            old.x = vp.x;
+            old.y = vp.y;
+            old.width = vp.width;
+            old.height = vp.height;
+            if (old.x != vp.x || old.y != vp.y || old.width != vp.width || old.height != vp.height)
+                retval = -EOVERFLOW;
+            if (!retval && copy_to_user((void __user *)arg, &old, sizeof(old)))
+                retval = -EFAULT;
+            break;
+        }
+
+        case FB536_IOCGETVIEWPORT2: {
+            struct fb_viewport2 vp;
+            struct fb_size2 sz;
+            fb536_snapshot(desc, &vp, &sz);
+            if (copy_to_user((void __user *)arg, &vp, sizeof(vp)))
+                retval = -EFAULT;
+            break;
+        }
+
+        case FB536_IOCGETSTATS: {
+            struct fb_stats *st;
+            u32 (*h)[256];
+
+            st = kmalloc(sizeof(*st), GFP_KERNEL);
+            h = kmalloc(4 * sizeof(*h), GFP_KERNEL);
+            if (!st || !h) {
+                retval = -ENOMEM;
+            } else if (fb536_lock_interruptible(dev)) {
+                retval = -ERESTARTSYS;
+            } else {
+                fb536_viewport_stats(dev, &desc->viewport, st, h);
+                fb536_unlock(dev);
+                if (copy_to_user((void __user *)arg, st, sizeof(*st)))
+                    retval = -EFAULT;
+            }
+            kfree(h);
+            kfree(st);
+            break;
+        }
+
+        case FB536_IOCGETTILES: {
+            struct fb_tiles t;
+            u64 __user *gens;
+            unsigned long r;
 
-            mutex_unlock(&dev->lock);
+            if (copy_from_user(&t, (void __user *)arg, sizeof(t))) return -EFAULT;
+            gens = u64_to_user_ptr(t.gens);
+
+            if (fb536_lock_interruptible(dev))
+                return -ERESTARTSYS;
+            t.tx = t.ty = t.ncols = t.nrows = 0;
+            if (viewport_usable(dev, &desc->viewport) &&
+                desc->viewport.width && desc->viewport.height) {
+                t.tx = desc->viewport.x >> FB536_TILE_SHIFT;
+                t.ty = desc->viewport.y >> FB536_TILE_SHIFT;
+                t.ncols = ((desc->viewport.x + desc->viewport.width - 1) >> FB536_TILE_SHIFT) - t.tx + 1;
+                t.nrows = ((desc->viewport.y + desc->viewport.height - 1) >> FB536_TILE_SHIFT) - t.ty + 1;
+            }
+            t.gen = dev->write_gen;
+            if ((u64)t.ncols * t.nrows > t.capacity) {
+                retval = -ENOSPC;
+            } else {
+                for (r = 0; r < t.nrows; r++) {
+                    if (copy_to_user(gens + r * t.ncols,
+                                     dev->tile_gen + (t.ty + r) * dev->tiles_x + t.tx,
+                                     t.ncols * sizeof(u64))) {
+                        retval = -EFAULT;
+                        break;
+                    }
+                }
+            }
+            fb536_unlock(dev);
+            if (retval != -EFAULT && copy_to_user((void __user *)arg, &t, sizeof(t)))
+                retval = -EFAULT;
             break;
         }
 
-        case FB536_IOCGETVIEWPORT:
-            mutex_lock(&dev->lock);
-            if (copy_to_user((void __user *)arg, &desc->viewport, sizeof(desc->viewport)))
+        case FB536_IOCDELTAREAD: {
+            struct fb_delta d;
+
+            if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+                return -EINVAL;
+            if (copy_from_user(&d, (void __user *)arg, sizeof(d))) return -EFAULT;
+
+            if (fb536_lock_interruptible(dev))
+                return -ERESTARTSYS;
+            retval = fb536_delta_read(desc, &d);
+            fb536_unlock(dev);
+            if (!retval && copy_to_user((void __user *)arg, &d, sizeof(d)))
                 retval = -EFAULT;
-            mutex_unlock(&dev->lock);
             break;
+        }
+
+        case FB536_IOCWRITERLE:
+            return fb536_write_rle(filp, (struct fb_rle_write __user *)arg);
+
+        case FB536_IOCTSETHISTORY:
+            if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
+            if (arg > FB536_MAX_HISTORY) return -EINVAL;
+            fb536_lock(dev);
+            /* History starts at the current generation when turned on */
+            if (!dev->hist_depth || !arg)
+                fb536_hist_clear(dev);
+            dev->hist_depth = arg;
+            while (dev->hist_versions > dev->hist_depth)
+                fb536_hist_evict_oldest(dev);
+            fb536_unlock(dev);
+            break;
+
+        case FB536_IOCREADGEN: {
+            struct fb_gen_read g;
+            u64 vp_size;
+
+            if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
+                return -EINVAL;
+            if (copy_from_user(&g, (void __user *)arg, sizeof(g))) return -EFAULT;
+
+            if (fb536_lock_interruptible(dev))
+                return -ERESTARTSYS;
+            vp_size = (u64)desc->viewport.width * desc->viewport.height * dev->bpp;
+            if (g.gen > dev->write_gen)
+                retval = -EINVAL;
+            else if (g.gen < dev->hist_floor || (!dev->hist_depth && g.gen != dev->write_gen))
+                retval = -ENOENT;
+            else if (viewport_usable(dev, &desc->viewport) && g.offset < vp_size && g.len) {
+                size_t n = min_t(u64, min_t(u32, g.len, INT_MAX), vp_size - g.offset);
+                retval = fb536_hist_read(dev, &desc->viewport, g.gen, u64_to_user_ptr(g.buf),
+                                         n, g.offset) ?: n;
+            }
+            fb536_unlock(dev);
+            break;
+        }
 
         case FB536_IOCTSETOP:
             if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
             if (arg > 5) return -EINVAL;
+            mutex_lock(&desc->wc_lock);
+            fb536_wc_flush(desc);
             desc->op = (int)arg;
+            mutex_unlock(&desc->wc_lock);
+            break;
+
+        case FB536_IOCTSETWAKERATE:
+            if (arg > FB536_MAX_WAKE_US) return -EINVAL;
+            fb536_lock(dev);
+            desc->wake_min_ns = (u64)arg * NSEC_PER_USEC;
+            fb536_unlock(dev);
+            break;
+
+        case FB536_IOCGETDAMAGE: {
+            struct fb_viewport2 d;
+            fb536_lock(dev);
+            d = desc->damage;
+            memset(&desc->damage, 0, sizeof(desc->damage));
+            fb536_unlock(dev);
+            if (copy_to_user((void __user *)arg, &d, sizeof(d)))
+                retval = -EFAULT;
+            break;
+        }
+
+        case FB536_IOCTSETWC:
+            if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
+            if (arg > FB536_MAX_WC_US) return -EINVAL;
+            mutex_lock(&desc->wc_lock);
+            fb536_wc_flush(desc);
+            WRITE_ONCE(desc->wc_us, arg);
+            mutex_unlock(&desc->wc_lock);
+            break;
+
+        case FB536_IOCTSETDELTA:
+            if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
+            if (arg > 1) return -EINVAL;
+            WRITE_ONCE(desc->delta, arg);
+            break;
+
+        case FB536_IOCTSETASYNC:
+            if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
+            if (arg > 1) return -EINVAL;
+            WRITE_ONCE(desc->async, arg);
+            break;
+
+        case FB536_IOCFLUSH:
+            fb536_wc_sync(desc);
+            fb536_delta_sync(dev);
+            retval = fb536_async_flush(desc);
+            break;
+
+        case FB536_IOCSHMEMFD: {
+            struct file *f;
+            int fd;
+
+            fd = get_unused_fd_flags(O_CLOEXEC);
+            if (fd < 0)
+                return fd;
+            fb536_lock(dev);
+            f = dev->shmem ? dentry_open(&dev->shmem->f_path, O_RDONLY | O_LARGEFILE, current_cred())
+                           : ERR_PTR(-ENODEV);
+            fb536_unlock(dev);
+            if (IS_ERR(f)) {
+                put_unused_fd(fd);
+                return PTR_ERR(f);
+            }
+            fd_install(fd, f);
+            retval = fd;
+            break;
+        }
+
+        case FB536_IOCEXPORTDMABUF: {
+            struct fb_dmabuf req;
+
+            if (copy_from_user(&req, (void __user *)arg, sizeof(req)))
+                return -EFAULT;
+            if (req.flags & ~FB536_DMABUF_WRITE)
+                return -EINVAL;
+            if ((req.flags & FB536_DMABUF_WRITE) && (filp->f_flags & O_ACCMODE) == O_RDONLY)
+                return -EINVAL;
+            retval = fb536_export_dmabuf(desc, &req);
+            if (retval)
+                return retval;
+            /* The fd is installed; a fault here leaves it to the caller */
+            if (copy_to_user((void __user *)arg, &req, sizeof(req)))
+                retval = -EFAULT;
             break;
+        }
 
         case FB536_IOCQGETOP:
             if ((filp->f_flags & O_ACCMODE) == O_RDONLY) return -EINVAL;
             retval = desc->op;
             break;
 
-        case FB536_IOCWAIT:
+        case FB536_IOCWAIT: {
+            struct fb536_wait_group *g;
+            u64 woke = 0, now, start;
+
             if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
                 return -EINVAL;
 
-            mutex_lock(&dev->lock);
+            fb536_lock(dev);
             desc->wake_flag = 0;
-            mutex_unlock(&dev->lock);
+            g = desc->group;
+            if (g)
+                g->refs++;
+            fb536_unlock(dev);
+
+            trace_fb536_wait_sleep(FB536_MINOR(dev), &desc->viewport, g != NULL);
+            start = ktime_get_ns();
+            if (!g) {
+                if (wait_event_interruptible(desc->wq, desc->wake_flag != 0)) {
+                    trace_fb536_wait_wake(FB536_MINOR(dev), -ERESTARTSYS, ktime_get_ns() - start, 0);
+                    return -ERESTARTSYS;
+                }
+            } else if (wait_event_interruptible_exclusive(g->wq,
+                           atomic_add_unless(&g->events, -1, 0) || READ_ONCE(desc->wake_flag))) {
+                /* Pass on a wakeup this waiter may have been picked for */
+                if (atomic_read(&g->events))
+                    wake_up_interruptible(&g->wq);
+                retval = -ERESTARTSYS;
+            }
 
-            if (wait_event_interruptible(desc->wq, desc->wake_flag != 0))
-                return -ERESTARTSYS;
+            now = ktime_get_ns();
+            if (!retval) {
+                woke = g ? READ_ONCE(g->wake_ns) : READ_ONCE(desc->wake_ns);
+                woke = min(woke, now);
+                fb536_count(dev, wakeups_useful, 1);
+                fb536_count_lat(dev->stats->wake_latency, now - woke);
+            }
+            trace_fb536_wait_wake(FB536_MINOR(dev), retval, now - start, woke ? now - woke : 0);
 
-            mutex_lock(&dev->lock);
+            fb536_lock(dev);
             desc->wake_flag = 0;
-            mutex_unlock(&dev->lock);
+            if (g)
+                fb536_group_put(dev, g);
+            fb536_unlock(dev);
+            break;
+        }
+
+        case FB536_IOCBINDEVENTFD:
+            retval = fb536_bind_eventfd(desc, (int)arg);
+            break;
+
+        case FB536_IOCJOINGROUP: {
+            struct fb_wait_group wg;
+            if (copy_from_user(&wg, (void __user *)arg, sizeof(wg))) return -EFAULT;
+            wg.name[sizeof(wg.name) - 1] = '\0';
+            retval = fb536_join_group(desc, wg.name);
             break;
+        }
 
         default:
             return -ENOTTY;
@@ -375,6 +2551,36 @@ static long fb536_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
+static loff_t fb536_llseek(struct file *filp, loff_t off, int whence) {
+    struct fb536_file_desc *desc = filp->private_data;
+    u64 start = ktime_get_ns();
+    loff_t ret = fb536_do_llseek(filp, off, whence);
+
+    if (fb536_recording(desc->dev))
+        fb536_record(desc, start, FB536_REC_LLSEEK, whence, off, 0, ret, 0, NULL, 0);
+    return ret;
+}
+
+static long fb536_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct fb536_file_desc *desc = filp->private_data;
+    u8 argbuf[sizeof_field(struct fb536_rec, argbuf)];
+    size_t arglen = 0;
+    u64 start;
+    long ret;
+
+    if (!fb536_recording(desc->dev))
+        return fb536_do_ioctl(filp, cmd, arg);
+    start = ktime_get_ns();
+
+    /* Keep small input structs so the call can be replayed */
+    if ((_IOC_DIR(cmd) & _IOC_WRITE) && _IOC_SIZE(cmd) <= sizeof(argbuf) &&
+        !copy_from_user(argbuf, (void __user *)arg, _IOC_SIZE(cmd)))
+        arglen = _IOC_SIZE(cmd);
+    ret = fb536_do_ioctl(filp, cmd, arg);
+    fb536_record(desc, start, FB536_REC_IOCTL, cmd, arg, 0, ret, 0, argbuf, arglen);
+    return ret;
+}
+
 static const struct file_operations fb536_fops = {
     .owner =    THIS_MODULE,
     .llseek =   fb536_llseek,
@@ -382,7 +2588,104 @@ static const struct file_operations fb536_fops = {
     .write =    fb536_write,
     .unlocked_ioctl = fb536_ioctl,
     .open =     fb536_open,
+    .flush =    fb536_flush,
+    .fsync =    fb536_fsync,
     .release =  fb536_release,
+    .fasync =   fb536_fasync,
+    .poll =     fb536_poll,
+};
+
+static void fb536_show_hist(struct seq_file *m, const char *name, const u64 *hist) {
+    int b;
+
+    seq_printf(m, "%s:\n", name);
+    for (b = 0; b < FB536_LAT_BUCKETS; b++)
+        if (hist[b])
+            seq_printf(m, "  >= %llu ns: %llu\n", b ? 1ULL << (b - 1) : 0ULL, hist[b]);
+}
+
+static int fb536_stats_show(struct seq_file *m, void *v) {
+    struct fb536_dev *dev = m->private;
+    static const char * const ops[] = { "set", "add", "sub", "and", "or", "xor" };
+    struct fb536_stats *t;
+    int cpu, i, j;
+
+    t = kzalloc(sizeof(*t), GFP_KERNEL);
+    if (!t)
+        return -ENOMEM;
+    for_each_possible_cpu(cpu) {
+        u64 *c = (u64 *)per_cpu_ptr(dev->stats, cpu);
+        for (j = 0; j < sizeof(*t) / sizeof(u64); j++)
+            ((u64 *)t)[j] += c[j];
+    }
+
+    seq_printf(m, "reads: %llu\nread_bytes: %llu\nwrites: %llu\n", t->reads, t->read_bytes, t->writes);
+    for (i = 0; i <= FB536_XOR; i++)
+        seq_printf(m, "write_bytes_%s: %llu\n", ops[i], t->write_bytes[i]);
+    for (i = 0; i <= FB536_IOC_MAXNR; i++)
+        if (t->ioctls[i])
+            seq_printf(m, "ioctl_%d: %llu\n", i, t->ioctls[i]);
+    seq_printf(m, "notifies: %llu\nnotify_scanned: %llu\n", t->notifies, t->notify_scanned);
+    seq_printf(m, "wakeups: %llu\nwakeups_useful: %llu\n", t->wakeups, t->wakeups_useful);
+    fb536_show_hist(m, "lock_wait", t->lock_wait);
+    fb536_show_hist(m, "lock_hold", t->lock_hold);
+    fb536_show_hist(m, "wake_latency", t->wake_latency);
+    kfree(t);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fb536_stats);
+
+static ssize_t fb536_record_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos) {
+    struct fb536_dev *dev = filp->private_data;
+    char tmp[4];
+    int len = snprintf(tmp, sizeof(tmp), "%d\n", READ_ONCE(dev->record));
+
+    return simple_read_from_buffer(buf, count, ppos, tmp, len);
+}
+
+/* The trace ring is allocated the first time recording is switched on */
+static ssize_t fb536_record_write(struct file *filp, const char __user *buf, size_t count, loff_t *ppos) {
+    struct fb536_dev *dev = filp->private_data;
+    unsigned int val;
+    int ret = kstrtouint_from_user(buf, count, 0, &val);
+
+    if (ret)
+        return ret;
+    if (val > 2)
+        return -EINVAL;
+    mutex_lock(&dev->rec_read_lock);
+    if (val && !kfifo_initialized(&dev->rec_fifo))
+        ret = kfifo_alloc(&dev->rec_fifo, max(record_entries, 2U), GFP_KERNEL);
+    if (!ret)
+        smp_store_release(&dev->record, val);
+    mutex_unlock(&dev->rec_read_lock);
+    return ret ? ret : count;
+}
+
+static const struct file_operations fb536_record_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = fb536_record_read,
+    .write = fb536_record_write,
+};
+
+/* Whole struct fb536_rec records, consumed as they are read */
+static ssize_t fb536_trace_read(struct file *filp, char __user *buf, size_t count, loff_t *ppos) {
+    struct fb536_dev *dev = filp->private_data;
+    unsigned int copied = 0;
+    int ret = 0;
+
+    mutex_lock(&dev->rec_read_lock);
+    if (kfifo_initialized(&dev->rec_fifo))
+        ret = kfifo_to_user(&dev->rec_fifo, buf, rounddown(count, sizeof(struct fb536_rec)), &copied);
+    mutex_unlock(&dev->rec_read_lock);
+    return ret ? ret : copied;
+}
+
+static const struct file_operations fb536_trace_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = fb536_trace_read,
 };
 
 static void fb536_setup_cdev(struct fb536_dev *dev, int index)
@@ -397,9 +2700,14 @@ static void fb536_setup_cdev(struct fb536_dev *dev, int index)
 
 static int __init fb536_init(void)
 {
-    int result, i;
+    struct fb536_frame frame;
+    int result, i = 0, j;
     dev_t dev = 0;
 
+    if (async_cpu >= 0 && (async_cpu >= nr_cpu_ids || !cpu_online(async_cpu))) {
+        printk(KERN_WARNING "fb536: async_cpu %d is not online\n", async_cpu);
+        return -EINVAL;
+    }
     if (major) {
         dev = MKDEV(major, 0);
         result = register_chrdev_region(dev, numminors, "fb536");
@@ -411,6 +2719,7 @@ static int __init fb536_init(void)
         printk(KERN_WARNING "fb536: can't get major %d\n", major);
         return result;
     }
+    fb536_debugfs = debugfs_create_dir("fb536", NULL);
 
     fb536_devices = kzalloc(numminors * sizeof(struct fb536_dev), GFP_KERNEL);
     if (!fb536_devices) {
@@ -419,28 +2728,99 @@ static int __init fb536_init(void)
     }
 
     for (i = 0; i < numminors; i++) {
+        char name[16];
+
         mutex_init(&fb536_devices[i].lock);
+        seqcount_mutex_init(&fb536_devices[i].geo_seq, &fb536_devices[i].lock);
+        mutex_init(&fb536_devices[i].resize_lock);
+        spin_lock_init(&fb536_devices[i].rec_lock);
+        mutex_init(&fb536_devices[i].rec_read_lock);
         INIT_LIST_HEAD(&fb536_devices[i].file_list);
+        INIT_LIST_HEAD(&fb536_devices[i].hist);
+        INIT_LIST_HEAD(&fb536_devices[i].groups);
+        INIT_DELAYED_WORK(&fb536_devices[i].cold_work, fb536_cold_work);
         fb536_devices[i].width = width;
         fb536_devices[i].height = height;
-        fb536_devices[i].size = width * height;
-        fb536_devices[i].data = vmalloc(fb536_devices[i].size);
-        if (!fb536_devices[i].data) {
-            result = -ENOMEM;
+        fb536_devices[i].bpp = 1;
+        fb536_devices[i].size = (unsigned long)width * height;
+        fb536_devices[i].node = i < minor_node_count ? minor_node[i] : node;
+        if (fb536_devices[i].node < FB536_NODE_INTERLEAVE || fb536_devices[i].node >= MAX_NUMNODES ||
+            (fb536_devices[i].node >= 0 && !node_state(fb536_devices[i].node, N_MEMORY))) {
+            printk(KERN_WARNING "fb536: no memory on node %d for minor %d\n", fb536_devices[i].node, i);
+            result = -EINVAL;
             goto fail;
         }
+        result = fb536_alloc_frame(&fb536_devices[i], fb536_devices[i].size, &frame);
+        if (result)
+            goto fail;
+        fb536_devices[i].data = frame.data;
+        fb536_devices[i].shmem = frame.shmem;
+        fb536_devices[i].shmem_pages = frame.pages;
         memset(fb536_devices[i].data, 0, fb536_devices[i].size);
+        fb536_devices[i].write_gen = 1;
+        fb536_devices[i].tiles_x = TILES((unsigned long)width);
+        fb536_devices[i].tiles_y = TILES((unsigned long)height);
+        fb536_devices[i].tile_gen = kvcalloc(fb536_devices[i].tiles_x * fb536_devices[i].tiles_y,
+                                             sizeof(u64), GFP_KERNEL);
+        if (!fb536_devices[i].tile_gen) {
+            result = -ENOMEM;
+            goto fail;
+        }
+        fb536_mark_tiles(&fb536_devices[i], 0, width - 1, 0, height - 1);
+        fb536_hist_clear(&fb536_devices[i]);
+        fb536_devices[i].hist_depth = clamp_t(int, history, 0, FB536_MAX_HISTORY);
+        fb536_devices[i].stats = alloc_percpu(struct fb536_stats);
+        if (!fb536_devices[i].stats) {
+            result = -ENOMEM;
+            goto fail;
+        }
+        result = fb536_delta_init(&fb536_devices[i]);
+        if (result)
+            goto fail;
+        spin_lock_init(&fb536_devices[i].async_lock);
+        INIT_LIST_HEAD(&fb536_devices[i].async_list);
+        kthread_init_work(&fb536_devices[i].async_work, fb536_async_work);
+        if (async_cpu >= 0)
+            fb536_devices[i].async_worker = kthread_create_worker_on_cpu(async_cpu, 0, "fb536/%d", i);
+        else
+            fb536_devices[i].async_worker = kthread_create_worker(0, "fb536/%d", i);
+        if (IS_ERR(fb536_devices[i].async_worker)) {
+            result = PTR_ERR(fb536_devices[i].async_worker);
+            fb536_devices[i].async_worker = NULL;
+            goto fail;
+        }
+        snprintf(name, sizeof(name), "%d", i);
+        fb536_devices[i].debugfs = debugfs_create_dir(name, fb536_debugfs);
+        debugfs_create_file("stats", 0444, fb536_devices[i].debugfs, &fb536_devices[i], &fb536_stats_fops);
+        debugfs_create_file("record", 0600, fb536_devices[i].debugfs, &fb536_devices[i], &fb536_record_fops);
+        debugfs_create_file("trace", 0400, fb536_devices[i].debugfs, &fb536_devices[i], &fb536_trace_fops);
+        debugfs_create_u64("trace_dropped", 0400, fb536_devices[i].debugfs, &fb536_devices[i].rec_dropped);
         fb536_setup_cdev(&fb536_devices[i], i);
+        if (fb536_devices[i].shmem)
+            schedule_delayed_work(&fb536_devices[i].cold_work, shmem_cold_secs * HZ);
     }
 
     return 0;
 
 fail:
+    debugfs_remove_recursive(fb536_debugfs);
     if (fb536_devices) {
-        for (i = 0; i < numminors; i++) {
-            if (fb536_devices[i].data)
-                vfree(fb536_devices[i].data);
-            cdev_del(&fb536_devices[i].cdev);
+        /* Minors before i are set up, i up to the step that failed, the rest not at all */
+        for (j = i; j >= 0; j--) {
+            if (j < i) {
+                cdev_del(&fb536_devices[j].cdev);
+                cancel_delayed_work_sync(&fb536_devices[j].cold_work);
+                cancel_work_sync(&fb536_devices[j].delta_work);
+            }
+            frame = fb536_dev_frame(&fb536_devices[j]);
+            fb536_free_frame(&frame);
+            kvfree(fb536_devices[j].tile_gen);
+            fb536_hist_clear(&fb536_devices[j]);
+            free_percpu(fb536_devices[j].stats);
+            fb536_delta_free(&fb536_devices[j]);
+            if (fb536_devices[j].async_worker)
+                kthread_destroy_worker(fb536_devices[j].async_worker);
+            kfifo_free(&fb536_devices[j].rec_fifo);
         }
         kfree(fb536_devices);
     }
@@ -450,13 +2830,24 @@ fail:
 
 static void __exit fb536_exit(void)
 {
+    struct fb536_frame frame;
     int i;
     dev_t devno = MKDEV(major, 0);
 
+    debugfs_remove_recursive(fb536_debugfs);
     if (fb536_devices) {
         for (i = 0; i < numminors; i++) {
             cdev_del(&fb536_devices[i].cdev);
-            vfree(fb536_devices[i].data);
+            cancel_delayed_work_sync(&fb536_devices[i].cold_work);
+            cancel_work_sync(&fb536_devices[i].delta_work);
+            fb536_delta_free(&fb536_devices[i]);
+            kthread_destroy_worker(fb536_devices[i].async_worker);
+            frame = fb536_dev_frame(&fb536_devices[i]);
+            fb536_free_frame(&frame);
+            kvfree(fb536_devices[i].tile_gen);
+            fb536_hist_clear(&fb536_devices[i]);
+            free_percpu(fb536_devices[i].stats);
+            kfifo_free(&fb536_devices[i].rec_fifo);
         }
         kfree(fb536_devices);
     }
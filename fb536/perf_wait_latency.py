@@ -0,0 +1,49 @@
+# perf script: FB536_IOCWAIT latency histograms from the fb536 tracepoints
+#
+#   perf record -e fb536:fb536_wait_wake -a -- <workload>
+#   perf script -s perf_wait_latency.py
+#
+# For each minor, prints log2 histograms of the time from a wake being
+# issued until the waiter ran (latency_ns) and of the time spent asleep
+# (sleep_ns). Interrupted waits are counted but not binned.
+
+from collections import defaultdict
+
+latency = defaultdict(lambda: defaultdict(int))
+sleep = defaultdict(lambda: defaultdict(int))
+interrupted = defaultdict(int)
+
+
+def bucket(ns):
+    return ns.bit_length()
+
+
+def fb536__fb536_wait_wake(event_name, context, common_cpu, common_secs, common_nsecs,
+                           common_pid, common_comm, common_callchain,
+                           minor, ret, sleep_ns, latency_ns, perf_sample_dict=None):
+    if ret != 0:
+        interrupted[minor] += 1
+        return
+    latency[minor][bucket(latency_ns)] += 1
+    sleep[minor][bucket(sleep_ns)] += 1
+
+
+def print_hist(title, hist):
+    total = sum(hist.values())
+    if not total:
+        return
+    print("  %s (%d waits)" % (title, total))
+    peak = max(hist.values())
+    for b in range(min(hist), max(hist) + 1):
+        lo = 1 << (b - 1) if b else 0
+        n = hist.get(b, 0)
+        print("    %12d ns %10d |%-40s|" % (lo, n, "*" * (n * 40 // peak)))
+
+
+def trace_end():
+    for minor in sorted(set(latency) | set(interrupted)):
+        print("fb536 minor %d" % minor)
+        print_hist("wake to run latency", latency[minor])
+        print_hist("time asleep", sleep[minor])
+        if interrupted[minor]:
+            print("  interrupted: %d" % interrupted[minor])
@@ -18,6 +18,12 @@
 #include <unistd.h>
 #include <sys/ioctl.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
 #include "fb536.h"
 
 #define DEVICE "/dev/fb536_0"
@@ -524,6 +530,846 @@ int test_multi_fd() {
     return 0;
 }
 
+/* Test 9: Non-destructive Resize */
+int test_resize_keep() {
+    int fd, ret, i;
+    unsigned char wbuf[100], rbuf[100];
+
+    printf("\n=== Test 9: Non-destructive Resize ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    ioctl(fd, FB536_IOCTSETSIZE, (1000 << 16) | 1000);
+    struct fb_viewport vp = {10, 10, 50, 2};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    for (i = 0; i < 100; i++)
+        wbuf[i] = i + 1;
+    write(fd, wbuf, 100);
+
+    /* Shrink: the written block lies inside the kept region */
+    ret = ioctl(fd, FB536_IOCTRESIZE, (600 << 16) | 400);
+    test_result("Resize (keep) to 600x400", ret == 0);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 100);
+    test_result("Content preserved after shrinking", memcmp(wbuf, rbuf, 100) == 0);
+
+    /* Grow: old content stays, new area is zero */
+    ret = ioctl(fd, FB536_IOCTRESIZE, (800 << 16) | 800);
+    test_result("Resize (keep) to 800x800", ret == 0);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 100);
+    test_result("Content preserved after growing", memcmp(wbuf, rbuf, 100) == 0);
+
+    struct fb_viewport vp2 = {600, 400, 100, 1};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp2);
+    memset(rbuf, 0xFF, 100);
+    read(fd, rbuf, 100);
+    int all_zero = 1;
+    for (i = 0; i < 100; i++)
+        if (rbuf[i] != 0) all_zero = 0;
+    test_result("Newly exposed area is zero", all_zero);
+
+    ret = ioctl(fd, FB536_IOCTRESIZE, (100 << 16) | 100);
+    test_result("Reject resize (keep) <= 255", ret < 0);
+
+    ioctl(fd, FB536_IOCTSETSIZE, (1000 << 16) | 1000);
+    close(fd);
+    return 0;
+}
+
+/* Test 10: 32-bit Geometry Interface */
+int test_large_geometry() {
+    int fd, ret;
+    unsigned char wbuf[100], rbuf[100];
+    struct fb_size2 sz = {70000, 256, 0, 0};
+    struct fb_viewport old_vp;
+
+    printf("\n=== Test 10: 32-bit Geometry Interface ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    ret = ioctl(fd, FB536_IOCSETSIZE2, &sz);
+    test_result("SETSIZE2 to 70000x256", ret == 0);
+
+    memset(&sz, 0, sizeof(sz));
+    ret = ioctl(fd, FB536_IOCGETSIZE2, &sz);
+    test_result("GETSIZE2 reports 70000x256", ret == 0 && sz.width == 70000 && sz.height == 256);
+
+    ret = ioctl(fd, FB536_IOCQGETSIZE);
+    test_result("Legacy QGETSIZE fails for width > 32767", ret < 0);
+
+    struct fb_viewport2 vp = {69900, 200, 100, 2};
+    ret = ioctl(fd, FB536_IOCSETVIEWPORT2, &vp);
+    test_result("SETVIEWPORT2 beyond 16-bit x", ret == 0);
+
+    ret = ioctl(fd, FB536_IOCGETVIEWPORT, &old_vp);
+    test_result("Legacy GETVIEWPORT fails for x > 65535", ret < 0);
+
+    memset(wbuf, 0x5A, 100);
+    write(fd, wbuf, 100);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 100);
+    test_result("Write/read through 32-bit viewport", memcmp(wbuf, rbuf, 100) == 0);
+    test_result("SEEK_END returns 200", lseek(fd, 0, SEEK_END) == 200);
+
+    struct fb_viewport2 bad = {0xFFFFFFF0u, 0, 0x20, 1};
+    ret = ioctl(fd, FB536_IOCSETVIEWPORT2, &bad);
+    test_result("Reject viewport whose x + width wraps", ret < 0);
+
+    sz.width = FB536_MAX_DIM2 + 1;
+    sz.height = 256;
+    ret = ioctl(fd, FB536_IOCSETSIZE2, &sz);
+    test_result("Reject SETSIZE2 above FB536_MAX_DIM2", ret < 0);
+
+    ioctl(fd, FB536_IOCTSETSIZE, (1000 << 16) | 1000);
+    close(fd);
+    return 0;
+}
+
+/* Test 11: Pixel Formats */
+int test_pixel_formats() {
+    int fd, ret;
+    unsigned char rbuf[8];
+    struct fb_size2 sz = {300, 300, 0, FB536_BPP_32};
+    struct fb_viewport2 vp = {10, 10, 2, 2};
+
+    printf("\n=== Test 11: Pixel Formats ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    ret = ioctl(fd, FB536_IOCSETSIZE2, &sz);
+    test_result("Switch to 32bpp", ret == 0);
+    ioctl(fd, FB536_IOCSETVIEWPORT2, &vp);
+    test_result("2x2 viewport at 32bpp is 16 bytes", lseek(fd, 0, SEEK_END) == 16);
+
+    /* Each channel saturates on its own */
+    unsigned char px32[4] = {250, 10, 0, 128};
+    unsigned char add32[4] = {10, 10, 5, 200};
+    lseek(fd, 0, SEEK_SET);
+    write(fd, px32, 4);
+    ioctl(fd, FB536_IOCTSETOP, FB536_ADD);
+    lseek(fd, 0, SEEK_SET);
+    write(fd, add32, 4);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 4);
+    test_result("32bpp ADD saturates per channel",
+                rbuf[0] == 255 && rbuf[1] == 20 && rbuf[2] == 5 && rbuf[3] == 255);
+
+    ioctl(fd, FB536_IOCTSETOP, FB536_SUB);
+    lseek(fd, 0, SEEK_SET);
+    write(fd, add32, 4);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 4);
+    test_result("32bpp SUB saturates per channel",
+                rbuf[0] == 245 && rbuf[1] == 10 && rbuf[2] == 0 && rbuf[3] == 55);
+
+    sz.bpp = FB536_BPP_16;
+    ret = ioctl(fd, FB536_IOCSETSIZE2, &sz);
+    test_result("Switch to 16bpp", ret == 0);
+
+    /* RGB565: r=30 g=60 b=1 plus r=5 g=5 b=5 -> r=31 g=63 b=6 */
+    unsigned short p16 = (30 << 11) | (60 << 5) | 1;
+    unsigned short a16 = (5 << 11) | (5 << 5) | 5;
+    unsigned short r16;
+    ioctl(fd, FB536_IOCTSETOP, FB536_SET);
+    lseek(fd, 0, SEEK_SET);
+    write(fd, &p16, 2);
+    ioctl(fd, FB536_IOCTSETOP, FB536_ADD);
+    lseek(fd, 0, SEEK_SET);
+    write(fd, &a16, 2);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, &r16, 2);
+    test_result("16bpp ADD saturates per RGB565 channel", r16 == ((31 << 11) | (63 << 5) | 6));
+
+    lseek(fd, 1, SEEK_SET);
+    ret = write(fd, &a16, 2);
+    test_result("16bpp ADD rejects unaligned writes", ret < 0);
+
+    sz.width = 1000;
+    sz.height = 1000;
+    sz.bpp = FB536_BPP_8;
+    ioctl(fd, FB536_IOCSETSIZE2, &sz);
+    close(fd);
+    return 0;
+}
+
+/* Test 12: In-kernel Viewport Statistics */
+int test_stats() {
+    int fd, ret, i;
+    unsigned char wbuf[100];
+    struct fb_stats st;
+
+    printf("\n=== Test 12: Viewport Statistics ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    ioctl(fd, FB536_IOCRESET);
+    struct fb_viewport vp = {5, 5, 10, 10};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    memset(wbuf, 0, 100);
+    for (i = 0; i < 10; i++)
+        wbuf[i * 10 + i] = 10 + i;    /* diagonal 10..19 */
+    write(fd, wbuf, 100);
+
+    ret = ioctl(fd, FB536_IOCGETSTATS, &st);
+    test_result("GETSTATS succeeds", ret == 0);
+    test_result("Count covers the 10x10 viewport", st.count == 100);
+    test_result("Sum, min and max", st.sum == 145 && st.min == 0 && st.max == 19);
+    test_result("Nonzero count", st.nonzero == 10);
+    test_result("Histogram bins", st.hist[0] == 90 && st.hist[10] == 1 && st.hist[19] == 1);
+
+    close(fd);
+    return 0;
+}
+
+/* Test 13: Tile Generations */
+int test_tiles() {
+    int fd, ret;
+    unsigned char wbuf[10];
+    unsigned long long before[8], after[8];
+    struct fb_tiles t;
+
+    printf("\n=== Test 13: Tile Generations ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 200, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+
+    memset(&t, 0, sizeof(t));
+    t.gens = (unsigned long)before;
+    t.capacity = 8;
+    ret = ioctl(fd, FB536_IOCGETTILES, &t);
+    test_result("GETTILES covers 4x2 tiles", ret == 0 && t.ncols == 4 && t.nrows == 2);
+
+    /* Pixel (70,10) lies in tile column 1, row 0 */
+    memset(wbuf, 1, sizeof(wbuf));
+    lseek(fd, 10 * 200 + 70, SEEK_SET);
+    write(fd, wbuf, 1);
+
+    t.gens = (unsigned long)after;
+    ioctl(fd, FB536_IOCGETTILES, &t);
+    test_result("Written tile carries the new generation", after[1] == t.gen && after[1] > before[1]);
+    test_result("Other tiles are unchanged",
+                after[0] == before[0] && after[2] == before[2] && after[5] == before[5]);
+
+    t.capacity = 2;
+    ret = ioctl(fd, FB536_IOCGETTILES, &t);
+    test_result("GETTILES reports -ENOSPC for a short array", ret < 0 && t.ncols * t.nrows == 8);
+
+    close(fd);
+    return 0;
+}
+
+/* Test 14: Delta Reads */
+int test_delta_read() {
+    int fd, ret, i;
+    static unsigned char dbuf[1 << 16], plain[200 * 100], rebuilt[200 * 100];
+    unsigned char val = 0x77;
+    __u32 off;
+    struct fb_delta d;
+    struct fb_delta_run *run;
+
+    printf("\n=== Test 14: Delta Reads ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 200, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    for (i = 0; i < (int)sizeof(plain); i++)
+        plain[i] = i % 251;
+    write(fd, plain, sizeof(plain));
+    lseek(fd, 0, SEEK_SET);
+    read(fd, plain, sizeof(plain));
+
+    memset(&d, 0, sizeof(d));
+    d.buf = (unsigned long)dbuf;
+    d.len = sizeof(dbuf);
+    d.flags = FB536_DELTA_FULL;
+    memset(rebuilt, 0, sizeof(rebuilt));
+    ret = ioctl(fd, FB536_IOCDELTAREAD, &d);
+    /* Rebuild the viewport from the runs and compare it with read() */
+    for (off = 0; ret == 0 && off < d.used; off += sizeof(*run) + ((run->length + 7) & ~7u)) {
+        run = (struct fb_delta_run *)(dbuf + off);
+        if (run->offset + run->length <= sizeof(rebuilt))
+            memcpy(rebuilt + run->offset, run + 1, run->length);
+    }
+    test_result("First delta read returns the full viewport",
+                ret == 0 && !(d.flags & FB536_DELTA_MORE) && memcmp(rebuilt, plain, sizeof(plain)) == 0);
+    run = (struct fb_delta_run *)dbuf;
+
+    d.flags = 0;
+    ret = ioctl(fd, FB536_IOCDELTAREAD, &d);
+    test_result("Unchanged viewport yields an empty delta", ret == 0 && d.used == 0);
+
+    /* Pixel (70,10): tile column 1 spans x 64..127 */
+    lseek(fd, 10 * 200 + 70, SEEK_SET);
+    write(fd, &val, 1);
+    ret = ioctl(fd, FB536_IOCDELTAREAD, &d);
+    test_result("Delta covers only the changed tile",
+                ret == 0 && d.used == 64 * (sizeof(*run) + 64) &&
+                run->offset == 64 && run->length == 64);
+    run = (struct fb_delta_run *)(dbuf + 10 * (sizeof(*run) + 64));
+    test_result("Delta carries the written byte",
+                run->offset == 10 * 200 + 64 && ((unsigned char *)(run + 1))[6] == 0x77);
+
+    d.len = 8;
+    d.flags = FB536_DELTA_FULL;
+    ret = ioctl(fd, FB536_IOCDELTAREAD, &d);
+    test_result("Too small a buffer gives -ENOSPC", ret < 0);
+
+    close(fd);
+    return 0;
+}
+
+/* Test 15: RLE Writes */
+int test_rle_write() {
+    int fd, ret, i, ok;
+    unsigned char rle[] = {226, 7, 2, 1, 2, 3};   /* 100 x 7, then 1 2 3 */
+    unsigned char rbuf[103];
+    struct fb_rle_write r = {(unsigned long)rle, sizeof(rle), 0};
+
+    printf("\n=== Test 15: RLE Writes ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 300, 1};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    ioctl(fd, FB536_IOCTSETOP, FB536_SET);
+
+    ret = ioctl(fd, FB536_IOCWRITERLE, &r);
+    test_result("WRITERLE returns decoded length", ret == 103);
+    test_result("WRITERLE advances the file offset", lseek(fd, 0, SEEK_CUR) == 103);
+
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 103);
+    for (ok = 1, i = 0; i < 100; i++)
+        if (rbuf[i] != 7) ok = 0;
+    test_result("Run decoded", ok);
+    test_result("Literal decoded", rbuf[100] == 1 && rbuf[101] == 2 && rbuf[102] == 3);
+
+    /* The file's op applies to decoded pixels */
+    ioctl(fd, FB536_IOCTSETOP, FB536_ADD);
+    lseek(fd, 0, SEEK_SET);
+    ioctl(fd, FB536_IOCWRITERLE, &r);
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 103);
+    test_result("Op applied to decoded data", rbuf[0] == 14 && rbuf[102] == 6);
+
+    r.len = 4;  /* literal of 3 cut short */
+    ret = ioctl(fd, FB536_IOCWRITERLE, &r);
+    test_result("Truncated stream rejected", ret < 0);
+
+    close(fd);
+    return 0;
+}
+
+/* Test 16: Frame History */
+int test_history() {
+    int fd, ret;
+    unsigned char v1[10], v2[10], rbuf[10];
+    unsigned long long gen1, dummy[64];
+    struct fb_tiles t;
+    struct fb_gen_read g;
+
+    printf("\n=== Test 16: Frame History ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCTSETOP, FB536_SET);
+    ret = ioctl(fd, FB536_IOCTSETHISTORY, 4);
+    test_result("Enable a 4-version history", ret == 0);
+
+    memset(v1, 0x11, 10);
+    write(fd, v1, 10);
+    memset(&t, 0, sizeof(t));
+    t.gens = (unsigned long)dummy;
+    t.capacity = 64;
+    ioctl(fd, FB536_IOCGETTILES, &t);
+    gen1 = t.gen;
+
+    memset(v2, 0x22, 10);
+    lseek(fd, 0, SEEK_SET);
+    write(fd, v2, 10);
+
+    memset(&g, 0, sizeof(g));
+    g.gen = gen1;
+    g.buf = (unsigned long)rbuf;
+    g.len = 10;
+    ret = ioctl(fd, FB536_IOCREADGEN, &g);
+    test_result("READGEN returns the older version", ret == 10 && memcmp(rbuf, v1, 10) == 0);
+
+    g.gen = gen1 + 1;
+    ret = ioctl(fd, FB536_IOCREADGEN, &g);
+    test_result("READGEN at the current generation", ret == 10 && memcmp(rbuf, v2, 10) == 0);
+
+    /* Push gen1 out of the 4-version ring */
+    for (int i = 0; i < 6; i++) {
+        lseek(fd, 0, SEEK_SET);
+        write(fd, v1, 10);
+    }
+    g.gen = gen1;
+    ret = ioctl(fd, FB536_IOCREADGEN, &g);
+    test_result("Evicted generation reports an error", ret < 0);
+
+    ioctl(fd, FB536_IOCTSETHISTORY, 0);
+    close(fd);
+
+    fd = open(DEVICE, O_RDONLY);
+    if (fd >= 0) {
+        ret = ioctl(fd, FB536_IOCTSETHISTORY, 4);
+        test_result("Read-only file cannot enable history", ret < 0);
+        close(fd);
+    }
+    return 0;
+}
+
+/* Test 17: Write Combining */
+int test_write_combining() {
+    int fd, rfd, ret, i;
+    unsigned char wbuf[10], rbuf[100];
+
+    printf("\n=== Test 17: Write Combining ===\n");
+    fd = open(DEVICE, O_RDWR);
+    rfd = open(DEVICE, O_RDWR);
+    if (fd < 0 || rfd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 2};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(rfd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    ret = ioctl(fd, FB536_IOCTSETWC, 500000);
+    test_result("Enable write combining (500ms deadline)", ret == 0);
+
+    memset(wbuf, 0x33, 10);
+    for (i = 0; i < 5; i++)
+        write(fd, wbuf, 10);
+    read(rfd, rbuf, 50);
+    test_result("Partial row stays buffered", rbuf[0] == 0);
+
+    lseek(fd, 0, SEEK_SET);
+    read(fd, rbuf, 50);
+    test_result("Writer reads its own buffered data", rbuf[0] == 0x33 && rbuf[49] == 0x33);
+
+    lseek(fd, 0, SEEK_SET);
+    memset(wbuf, 0x44, 10);
+    for (i = 0; i < 10; i++)
+        write(fd, wbuf, 10);
+    lseek(rfd, 0, SEEK_SET);
+    read(rfd, rbuf, 100);
+    test_result("Completed row is applied", rbuf[0] == 0x44 && rbuf[99] == 0x44);
+
+    write(fd, wbuf, 10);
+    usleep(700000);
+    lseek(rfd, 100, SEEK_SET);
+    read(rfd, rbuf, 10);
+    test_result("Deadline flushes a partial row", rbuf[0] == 0x44);
+
+    write(fd, wbuf, 10);
+    fsync(fd);
+    lseek(rfd, 110, SEEK_SET);
+    read(rfd, rbuf, 10);
+    test_result("fsync flushes", rbuf[0] == 0x44);
+
+    ioctl(fd, FB536_IOCTSETWC, 0);
+    close(rfd);
+    close(fd);
+    return 0;
+}
+
+/* Test 18: Damage Aggregation */
+int test_damage() {
+    int fd, wfd, ret;
+    unsigned char wbuf[10];
+    struct fb_viewport2 d;
+
+    printf("\n=== Test 18: Damage Aggregation ===\n");
+    fd = open(DEVICE, O_RDWR);
+    wfd = open(DEVICE, O_RDWR);
+    if (fd < 0 || wfd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ret = ioctl(fd, FB536_IOCTSETWAKERATE, 100000);
+    test_result("Set a 100ms wake interval", ret == 0);
+    ioctl(fd, FB536_IOCGETDAMAGE, &d);
+
+    /* Row 10 and row 50 of a full-width writer viewport */
+    struct fb_viewport wvp = {0, 10, 200, 1};
+    memset(wbuf, 1, sizeof(wbuf));
+    ioctl(wfd, FB536_IOCSETVIEWPORT, &wvp);
+    write(wfd, wbuf, 10);
+    wvp.y = 50;
+    ioctl(wfd, FB536_IOCSETVIEWPORT, &wvp);
+    write(wfd, wbuf, 10);
+
+    ret = ioctl(fd, FB536_IOCGETDAMAGE, &d);
+    test_result("Damage spans both writes, clipped to the viewport",
+                ret == 0 && d.x == 0 && d.y == 10 && d.width == 100 && d.height == 41);
+    ioctl(fd, FB536_IOCGETDAMAGE, &d);
+    test_result("GETDAMAGE clears the damage", d.width == 0 && d.height == 0);
+
+    close(wfd);
+    close(fd);
+    return 0;
+}
+
+static int group_woken;
+static pthread_mutex_t group_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void* group_waiter_thread(void* arg) {
+    int fd = open(DEVICE, O_RDWR);
+    struct fb_wait_group wg = {"farm"};
+    struct fb_viewport vp = {0, 0, 100, 100};
+
+    if (fd < 0)
+        return NULL;
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCJOINGROUP, &wg);
+    ioctl(fd, FB536_IOCWAIT);
+    pthread_mutex_lock(&group_lock);
+    group_woken++;
+    pthread_mutex_unlock(&group_lock);
+    close(fd);
+    return NULL;
+}
+
+/* Test 19: Exclusive Wait Groups */
+int test_wait_group() {
+    pthread_t threads[3];
+    unsigned char buf[10] = {0};
+    int fd, i, woken;
+
+    printf("\n=== Test 19: Exclusive Wait Groups ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+    struct fb_viewport vp = {0, 0, 100, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+
+    group_woken = 0;
+    for (i = 0; i < 3; i++)
+        pthread_create(&threads[i], NULL, group_waiter_thread, NULL);
+    sleep(1);
+
+    write(fd, buf, 10);
+    usleep(300000);
+    pthread_mutex_lock(&group_lock);
+    woken = group_woken;
+    pthread_mutex_unlock(&group_lock);
+    test_result("One write wakes exactly one group member", woken == 1);
+
+    for (i = 0; i < 2; i++) {
+        lseek(fd, 0, SEEK_SET);
+        write(fd, buf, 10);
+        usleep(100000);
+    }
+    for (i = 0; i < 3; i++)
+        pthread_join(threads[i], NULL);
+    test_result("Each further write wakes one more member", group_woken == 3);
+
+    close(fd);
+    return 0;
+}
+
+/* Test 20: Asynchronous Notification */
+static volatile sig_atomic_t sigio_seen = 0;
+
+static void sigio_handler(int sig) {
+    sigio_seen = 1;
+}
+
+int test_async_notify() {
+    int fd, wfd, efd, ret;
+    unsigned char wbuf[10];
+    uint64_t count = 0;
+
+    printf("\n=== Test 20: Asynchronous Notification ===\n");
+    fd = open(DEVICE, O_RDWR);
+    wfd = open(DEVICE, O_RDWR);
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0 || wfd < 0 || efd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 100};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ret = ioctl(fd, FB536_IOCBINDEVENTFD, efd);
+    test_result("Bind eventfd", ret == 0);
+
+    signal(SIGIO, sigio_handler);
+    fcntl(fd, F_SETOWN, getpid());
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_ASYNC);
+
+    memset(wbuf, 1, sizeof(wbuf));
+    ioctl(wfd, FB536_IOCSETVIEWPORT, &vp);
+    write(wfd, wbuf, 10);
+
+    ret = read(efd, &count, sizeof(count));
+    test_result("Intersecting write signals the eventfd", ret == sizeof(count) && count >= 1);
+    test_result("Intersecting write raises SIGIO", sigio_seen);
+
+    struct fb_viewport far = {500, 500, 10, 10};
+    ioctl(wfd, FB536_IOCSETVIEWPORT, &far);
+    write(wfd, wbuf, 10);
+    ret = read(efd, &count, sizeof(count));
+    test_result("Disjoint write does not signal", ret < 0);
+
+    ioctl(fd, FB536_IOCBINDEVENTFD, -1);
+    ioctl(wfd, FB536_IOCSETVIEWPORT, &vp);
+    write(wfd, wbuf, 10);
+    ret = read(efd, &count, sizeof(count));
+    test_result("Unbound eventfd is not signalled", ret < 0);
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_ASYNC);
+    signal(SIGIO, SIG_DFL);
+    close(efd);
+    close(wfd);
+    close(fd);
+    return 0;
+}
+
+/* Test 21: Delta Writes */
+int test_delta_write() {
+    int fd, fd2, rfd, efd, ret;
+    unsigned char wbuf[100], rbuf[100];
+    uint64_t count = 0;
+
+    printf("\n=== Test 21: Delta Writes ===\n");
+    fd = open(DEVICE, O_RDWR);
+    fd2 = open(DEVICE, O_RDWR);
+    rfd = open(DEVICE, O_RDWR);
+    efd = eventfd(0, EFD_NONBLOCK);
+    if (fd < 0 || fd2 < 0 || rfd < 0 || efd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 1};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd2, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(rfd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    ioctl(rfd, FB536_IOCBINDEVENTFD, efd);
+    ret = ioctl(fd, FB536_IOCTSETDELTA, 1);
+    test_result("Enable delta mode", ret == 0);
+    ioctl(fd2, FB536_IOCTSETDELTA, 1);
+    ioctl(fd, FB536_IOCTSETOP, FB536_XOR);
+    ioctl(fd2, FB536_IOCTSETOP, FB536_XOR);
+
+    memset(wbuf, 0x0F, sizeof(wbuf));
+    ret = write(fd, wbuf, 100);
+    memset(wbuf, 0xF0, sizeof(wbuf));
+    write(fd2, wbuf, 100);
+    read(rfd, rbuf, 100);
+    test_result("XOR deltas of two files merge on read", ret == 100 && rbuf[0] == 0xFF && rbuf[99] == 0xFF);
+
+    usleep(100000);
+    ret = read(efd, &count, sizeof(count));
+    test_result("Merged deltas notify waiters", ret == sizeof(count) && count >= 1);
+
+    ioctl(fd2, FB536_IOCTSETOP, FB536_AND);
+    memset(wbuf, 0x3C, sizeof(wbuf));
+    write(fd2, wbuf, 100);
+    memset(wbuf, 0x01, sizeof(wbuf));
+    write(fd, wbuf, 100);
+    lseek(rfd, 0, SEEK_SET);
+    read(rfd, rbuf, 100);
+    test_result("Changing the op keeps write order", rbuf[0] == 0x3D && rbuf[99] == 0x3D);
+
+    ioctl(fd, FB536_IOCTSETDELTA, 0);
+    ioctl(fd2, FB536_IOCTSETDELTA, 0);
+    ioctl(rfd, FB536_IOCBINDEVENTFD, -1);
+    close(efd);
+    close(rfd);
+    close(fd2);
+    close(fd);
+    return 0;
+}
+
+/* Test 22: Asynchronous Writes */
+int test_async_write() {
+    int fd, rfd, ret, i;
+    unsigned char wbuf[100], rbuf[100];
+    struct pollfd pfd;
+
+    printf("\n=== Test 22: Asynchronous Writes ===\n");
+    fd = open(DEVICE, O_RDWR);
+    rfd = open(DEVICE, O_RDWR);
+    if (fd < 0 || rfd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 100, 10};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(rfd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    ret = ioctl(fd, FB536_IOCTSETASYNC, 1);
+    test_result("Enable async writes", ret == 0);
+
+    for (i = 0; i < 10; i++) {
+        memset(wbuf, i + 1, sizeof(wbuf));
+        ret = write(fd, wbuf, 100);
+    }
+    test_result("Queued write returns its length", ret == 100);
+    ret = ioctl(fd, FB536_IOCFLUSH);
+    read(rfd, rbuf, 100);
+    test_result("Flush applies the queue", ret == 0 && rbuf[0] == 1);
+    lseek(rfd, 900, SEEK_SET);
+    read(rfd, rbuf, 100);
+    test_result("Queued writes apply in order", rbuf[0] == 10 && rbuf[99] == 10);
+
+    lseek(fd, 0, SEEK_SET);
+    write(fd, wbuf, 100);
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    ret = poll(&pfd, 1, 1000);
+    test_result("poll reports the drained queue", ret == 1 && (pfd.revents & POLLOUT));
+
+    ioctl(fd, FB536_IOCTSETASYNC, 0);
+    close(rfd);
+    close(fd);
+    return 0;
+}
+
+/* Test 23: Shmem Frame Export */
+int test_shmem_fd() {
+    int fd, sfd, ret, width;
+    unsigned char wbuf[100], *map;
+
+    printf("\n=== Test 23: Shmem Frame Export ===\n");
+    fd = open(DEVICE, O_RDWR);
+    if (fd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    sfd = ioctl(fd, FB536_IOCSHMEMFD);
+    if (sfd < 0) {
+        printf("%s Module not loaded with shmem=1, skipping\n", INFO);
+        test_result("Export fails with ENODEV", errno == ENODEV);
+        close(fd);
+        return 0;
+    }
+    test_result("Export the frame as an fd", sfd >= 0);
+
+    struct fb_viewport vp = {0, 0, 100, 1};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    width = ioctl(fd, FB536_IOCQGETSIZE) >> 16;
+    memset(wbuf, 0x5a, sizeof(wbuf));
+    write(fd, wbuf, 100);
+
+    map = mmap(NULL, width, PROT_READ, MAP_SHARED, sfd, 0);
+    test_result("Map the exported frame", map != MAP_FAILED);
+    if (map != MAP_FAILED) {
+        test_result("Writes show through the mapping", map[0] == 0x5a && map[99] == 0x5a);
+        munmap(map, width);
+    }
+    ret = write(sfd, wbuf, 1);
+    test_result("Exported fd is read-only", ret < 0);
+
+    close(sfd);
+    close(fd);
+    return 0;
+}
+
+/* Test 24: dma-buf Export */
+int test_dmabuf() {
+    int fd, rfd, ret;
+    unsigned char rbuf[20], *map;
+    struct fb_viewport2 d;
+    struct dma_buf_sync sync;
+
+    printf("\n=== Test 24: dma-buf Export ===\n");
+    fd = open(DEVICE, O_RDWR);
+    rfd = open(DEVICE, O_RDWR);
+    if (fd < 0 || rfd < 0) {
+        perror("open");
+        return -1;
+    }
+
+    struct fb_viewport vp = {0, 0, 1000, 1000};
+    ioctl(fd, FB536_IOCSETVIEWPORT, &vp);
+    ioctl(fd, FB536_IOCRESET);
+    struct fb_viewport rvp = {100, 20, 20, 10};
+    ioctl(rfd, FB536_IOCSETVIEWPORT, &rvp);
+
+    struct fb_dmabuf req = { {100, 20, 20, 10}, FB536_DMABUF_WRITE };
+    ret = ioctl(fd, FB536_IOCEXPORTDMABUF, &req);
+    test_result("Export a region as a dma-buf", ret == 0 && req.fd >= 0);
+    if (ret) {
+        close(rfd);
+        close(fd);
+        return -1;
+    }
+    test_result("Region offset and stride", req.stride == 1000 && req.offset == (20 * 1000 + 100) % 4096);
+
+    map = mmap(NULL, req.size, PROT_READ | PROT_WRITE, MAP_SHARED, req.fd, 0);
+    test_result("Map the dma-buf", map != MAP_FAILED);
+    if (map != MAP_FAILED) {
+        ioctl(rfd, FB536_IOCGETDAMAGE, &d);
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE;
+        ioctl(req.fd, DMA_BUF_IOCTL_SYNC, &sync);
+        memset(map + req.offset, 0x77, 20);
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+        ioctl(req.fd, DMA_BUF_IOCTL_SYNC, &sync);
+
+        read(rfd, rbuf, 20);
+        test_result("Writes through the dma-buf reach the frame", rbuf[0] == 0x77 && rbuf[19] == 0x77);
+        ret = ioctl(rfd, FB536_IOCGETDAMAGE, &d);
+        test_result("Ending CPU access notifies the region",
+                    ret == 0 && d.x == 100 && d.y == 20 && d.width == 20 && d.height == 10);
+        munmap(map, req.size);
+    }
+    close(req.fd);
+
+    req = (struct fb_dmabuf){ {990, 0, 20, 1}, 0 };
+    ret = ioctl(fd, FB536_IOCEXPORTDMABUF, &req);
+    test_result("Region outside the frame is rejected", ret < 0 && errno == EINVAL);
+
+    close(rfd);
+    close(fd);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     printf("\n");
     printf("╔════════════════════════════════════════════════════════════╗\n");
@@ -539,6 +1385,22 @@ int main(int argc, char *argv[]) {
     test_seek();
     // test_wait_notification(); // SKIPPED: pthread_cancel doesn't work with blocking ioctl
     test_multi_fd();
+    test_resize_keep();
+    test_large_geometry();
+    test_pixel_formats();
+    test_stats();
+    test_tiles();
+    test_delta_read();
+    test_rle_write();
+    test_history();
+    test_write_combining();
+    test_damage();
+    test_wait_group();
+    test_async_notify();
+    test_delta_write();
+    test_async_write();
+    test_shmem_fd();
+    test_dmabuf();
 
     printf("\n");
     printf("╔════════════════════════════════════════════════════════════╗\n");